@@ -6,12 +6,17 @@
 /*
  * STUDENT NUMBER: s1532620
  */
-#include <infos/mm/page-allocator.h>
+#include "buddy.h"
+
 #include <infos/mm/mm.h>
 #include <infos/kernel/kernel.h>
+#include <infos/kernel/cmdline.h>
 #include <infos/kernel/log.h>
 #include <infos/util/math.h>
 #include <infos/util/printf.h>
+#include <infos/util/lock.h>
+
+#include "cycle-counter.h"
 
 using namespace infos::kernel;
 using namespace infos::mm;
@@ -19,8 +24,120 @@ using namespace infos::util;
 
 #define MAX_ORDER	17
 
+// The number of pages moved between the hot page cache and the free areas when the cache is refilled.
+#define PCP_BATCH	16
+// When the hot page cache holds more than PCP_HIGH pages, it is drained down to PCP_LOW pages.
+#define PCP_HIGH	64
+#define PCP_LOW		(PCP_HIGH - PCP_BATCH)
+
+// In lazy coalescing mode, once more than UNMERGED_HIGH freed blocks are waiting to be merged, they are all merged.
+#define UNMERGED_HIGH	256
+
+// The size of a page, in bytes.
+#define PAGE_BYTES	0x1000
+// The maximum number of zeroed pages kept ready in the zeroed page pool.
+#define ZERO_POOL_HIGH	256
+// While the zeroed page pool holds fewer than ZERO_POOL_LOW pages, freed single pages are zeroed and
+// added to it.
+#define ZERO_POOL_LOW	32
+
+// The number of blocks each benchmark pattern holds at once, as long as that is no more than
+// 1/BENCH_FREE_SHARE of the free memory.
+#define BENCH_BATCH	128
+#define BENCH_FREE_SHARE	8
+// The largest order the benchmark measures, and how many times it repeats each pattern, when it is
+// asked for on the kernel command line.
+#define BENCH_MAX_ORDER	10
+#define BENCH_ROUNDS	100
+
+// Memory is grouped by migrate type in pageblocks of 2^PAGEBLOCK_ORDER pages.
+#define PAGEBLOCK_ORDER	9
+
+// Allocations that fall back to DMA32 memory must leave 1/LOWMEM_RESERVE_RATIO of the normal zone's
+// size free in the DMA32 zone.
+#define LOWMEM_RESERVE_RATIO	256
+
+// The order in which the other migrate types are stolen from, when a type runs out of free blocks.
+static const MigrateType::MigrateType migrate_fallbacks[MIGRATE_TYPES][MIGRATE_TYPES - 1] = {
+	{ MigrateType::RECLAIMABLE, MigrateType::MOVABLE },	// UNMOVABLE
+	{ MigrateType::UNMOVABLE, MigrateType::MOVABLE },	// RECLAIMABLE
+	{ MigrateType::RECLAIMABLE, MigrateType::UNMOVABLE },	// MOVABLE
+};
+
+// Set by "pgalloc.bench=1" on the kernel command line, to run the benchmark once memory is available.
+static bool pgalloc_benchmark_requested;
+
+RegisterCmdLineArgument(PageAllocatorBenchmark, "pgalloc.bench")
+{
+	pgalloc_benchmark_requested = value[0] && value[0] != '0';
+}
+
+// Set by "pgalloc.lazy=1" on the kernel command line, to start in lazy coalescing mode.
+static bool pgalloc_lazy_requested;
+
+RegisterCmdLineArgument(PageAllocatorLazy, "pgalloc.lazy")
+{
+	pgalloc_lazy_requested = value[0] && value[0] != '0';
+}
+
+/**
+ * A lock that spins until it is free.  It also disables interrupts on the local CPU while it is
+ * held, so that it can be taken from interrupt context without deadlocking against itself.
+ */
+class SpinLock
+{
+public:
+	SpinLock() : _locked(0) { }
+
+	void lock()
+	{
+		while (__atomic_exchange_n(&_locked, 1, __ATOMIC_ACQUIRE)) {
+			// Wait for the lock to look free before trying to take it again, so that waiting CPUs
+			// do not keep pulling the cache line away from the CPU holding it.
+			while (__atomic_load_n(&_locked, __ATOMIC_RELAXED)) {
+				asm volatile("pause");
+			}
+		}
+	}
+
+	void unlock()
+	{
+		__atomic_store_n(&_locked, 0, __ATOMIC_RELEASE);
+	}
+
+private:
+	uint32_t _locked;
+};
+
+/**
+ * Holds a SpinLock, with interrupts disabled, for as long as it is in scope.
+ */
+class UniqueSpinLock
+{
+public:
+	UniqueSpinLock(SpinLock& lock) : _lock(lock) { _lock.lock(); }
+	~UniqueSpinLock() { _lock.unlock(); }
+
+private:
+	// Interrupts are disabled before the lock is taken, and enabled again after it is released.
+	UniqueIRQLock _irq;
+	SpinLock& _lock;
+};
+
 /**
  * A buddy page allocation algorithm.
+ *
+ * Every public entry point takes the allocator lock itself, so the allocator does not rely on its
+ * callers for mutual exclusion, on one CPU or several.  The private helpers assume the lock is
+ * already held.  There is a single lock for the whole allocator: InfOS only brings up the boot
+ * CPU, so it is never contended, and there is nothing for per-zone or per-order locks to win yet.
+ * Pages move between the hot page cache and the free areas in batches, so the free areas are only
+ * touched once per batch rather than once per single-page allocation.
+ *
+ * Pageblocks are grouped by migrate type, but every caller in the kernel goes through the untyped
+ * alloc_pages(), which allocates unmovable memory.  Until something allocates movable or reclaimable
+ * memory through the typed overload, the grouping has no effect: all memory starts off unmovable,
+ * and nothing is ever stolen from or claimed for another type.
  */
 class BuddyPageAllocator : public PageAllocatorAlgorithm
 {
@@ -82,33 +199,138 @@ private:
 	}
 	
 	/**
-	 * Inserts a block into the free list of the given order.  The block is inserted in ascending order.
-	 * @param pgd The page descriptor of the block to insert.
-	 * @param order The order in which to insert the block.
-	 * @return Returns the slot (i.e. a pointer to the pointer that points to the block) that the block
-	 * was inserted into.
+	 * Logs one line of benchmark results.
+	 * @param pattern The name of the allocation pattern.
+	 * @param order The order of the blocks that were timed.
+	 * @param ops The number of blocks that were allocated and freed.
+	 * @param alloc_cycles The total cycles spent allocating.
+	 * @param free_cycles The total cycles spent freeing.
+	 * @param failures The number of allocations that failed.
+	 */
+	static void log_benchmark(const char *pattern, int order, uint64_t ops, uint64_t alloc_cycles,
+		uint64_t free_cycles, uint64_t failures)
+	{
+		mm_log.messagef(LogLevel::INFO, "bench buddy pattern=%s order=%d ops=%lu alloc_cycles=%lu free_cycles=%lu failures=%lu",
+			pattern, order, ops, ops ? alloc_cycles / ops : 0, ops ? free_cycles / ops : 0, failures);
+	}
+
+	/**
+	 * Returns the index of the given page descriptor within the range managed by the allocator.
+	 * @param pgd The page descriptor to calculate the index of.
+	 */
+	inline uint64_t block_index(const PageDescriptor *pgd) const
+	{
+		return pgd - _page_descriptors;
+	}
+
+	/**
+	 * Returns TRUE if the supplied page descriptor is the first page of a free block in the
+	 * given order, i.e. it is currently linked into one of the free lists for that order.
+	 * @param pgd The page descriptor to test.
+	 * @param order The order the block should be free in.
+	 */
+	inline bool is_free_block(const PageDescriptor *pgd, int order) const
+	{
+		uint64_t index = block_index(pgd);
+		return index < _nr_page_descriptors && _free_order[index] == order;
+	}
+
+	/**
+	 * Returns the migrate type of the pageblock that contains the given page.
+	 * @param pgd The page descriptor of the page.
+	 */
+	inline MigrateType::MigrateType pageblock_type(const PageDescriptor *pgd) const
+	{
+		return (MigrateType::MigrateType)_pageblock_type[block_index(pgd) >> PAGEBLOCK_ORDER];
+	}
+
+	/**
+	 * Returns the zone that the given page is in.  Blocks never straddle the zone boundary, as it is
+	 * aligned to a much larger order than MAX_ORDER.
+	 * @param pgd The page descriptor of the page.
+	 */
+	static inline Zone::Zone page_zone(const PageDescriptor *pgd)
+	{
+		return sys.mm().pgalloc().pgd_to_pfn(pgd) < DMA32_LIMIT_PFN ? Zone::DMA32 : Zone::NORMAL;
+	}
+
+	/**
+	 * Links a block in at the head of a free list.  The block goes on the list for the zone it is in.
+	 * @param pgd The page descriptor of the block to link in.
+	 * @param order The order of the free list.
+	 * @param type The migrate type of the free list.
 	 */
-	PageDescriptor **insert_block(PageDescriptor *pgd, int order)
+	void link_block(PageDescriptor *pgd, int order, MigrateType::MigrateType type)
 	{
-		//mm_log.messagef(LogLevel::DEBUG, "INSERTING BLOCK:%p INTO ORDER:%d", sys.mm().pgalloc().pgd_to_pfn(pgd), order);
-		// Starting from the _free_area array, find the slot in which the page descriptor
-		// should be inserted.
+		uint64_t index = block_index(pgd);
+		Zone::Zone zone = page_zone(pgd);
 
-		PageDescriptor **slot = &_free_areas[order];
-		// Iterate whilst there is a slot, and whilst the page descriptor pointer is numerically
-		// greater than what the slot is pointing to.
-		while (*slot && pgd > *slot) {
-			slot = &(*slot)->next_free;
+		// Link the block in front of the current head of the list.
+		pgd->next_free = _free_areas[zone][order][type];
+		if (pgd->next_free) {
+			_prev_free[block_index(pgd->next_free)] = index;
 		}
-		
-		// Insert the page descriptor into the linked list.
-		pgd->next_free = *slot;
-		*slot = pgd;
-		
-		// Return the insert point (i.e. slot)
-		return slot;
+
+		_prev_free[index] = NO_PREV;
+		_free_areas[zone][order][type] = pgd;
+		_nonempty_orders[zone][type] |= (1u << order);
+		_zone_free_pages[zone] += pages_per_block(order);
+		_stats.orders[order].free_blocks++;
+
+		// Remember which order the block is free in, so that it can be found again without
+		// walking the list.
+		_free_order[index] = order;
 	}
-	
+
+	/**
+	 * Unlinks a block from a free list.
+	 * @param pgd The page descriptor of the block to unlink.
+	 * @param order The order of the free list.
+	 * @param type The migrate type of the free list.
+	 */
+	void unlink_block(PageDescriptor *pgd, int order, MigrateType::MigrateType type)
+	{
+		uint64_t index = block_index(pgd);
+		Zone::Zone zone = page_zone(pgd);
+
+		// Make sure the block actually exists.  Panic the system if it does not.
+		assert(_free_order[index] == order);
+
+		// Unlink the block from its neighbours, or from the head of the free list.
+		uint32_t prev = _prev_free[index];
+		if (prev != NO_PREV) {
+			_page_descriptors[prev].next_free = pgd->next_free;
+		} else {
+			_free_areas[zone][order][type] = pgd->next_free;
+
+			// If that was the last block in the list, the order is now empty for this type.
+			if (!_free_areas[zone][order][type]) {
+				_nonempty_orders[zone][type] &= ~(1u << order);
+			}
+		}
+
+		if (pgd->next_free) {
+			_prev_free[block_index(pgd->next_free)] = prev;
+		}
+
+		pgd->next_free = NULL;
+		_prev_free[index] = NO_PREV;
+		_free_order[index] = NOT_FREE;
+		_zone_free_pages[zone] -= pages_per_block(order);
+		_stats.orders[order].free_blocks--;
+	}
+
+	/**
+	 * Inserts a block at the head of the free list of the given order.  The block goes on the list for
+	 * the migrate type of the pageblock its first page is in.
+	 * @param pgd The page descriptor of the block to insert.
+	 * @param order The order in which to insert the block.
+	 */
+	void insert_block(PageDescriptor *pgd, int order)
+	{
+		link_block(pgd, order, pageblock_type(pgd));
+	}
+
 	/**
 	 * Removes a block from the free list of the given order.  The block MUST be present in the free-list, otherwise
 	 * the system will panic.
@@ -117,331 +339,1718 @@ private:
 	 */
 	void remove_block(PageDescriptor *pgd, int order)
 	{
-		//mm_log.messagef(LogLevel::DEBUG, "REMOVING BLOCK:%p IN ORDER:%d",sys.mm().pgalloc().pgd_to_pfn(pgd), order);
-		// Starting from the _free_area array, iterate until the block has been located in the linked-list.
-		PageDescriptor **slot = &_free_areas[order];
-		while (*slot && pgd != *slot) {
-			slot = &(*slot)->next_free;
+		unlink_block(pgd, order, pageblock_type(pgd));
+	}
+
+	/**
+	 * Changes the migrate type of a pageblock, moving every free block that starts inside the pageblock
+	 * over to the free lists of the new type.
+	 * @param pgd The page descriptor of any page in the pageblock.
+	 * @param type The new migrate type of the pageblock.
+	 */
+	void set_pageblock_type(PageDescriptor *pgd, MigrateType::MigrateType type)
+	{
+		MigrateType::MigrateType old_type = pageblock_type(pgd);
+		if (old_type == type) {
+			return;
 		}
 
-		// Make sure the block actually exists.  Panic the system if it does not.
-		assert(*slot == pgd);
-		
-		// Remove the block from the free list.
-		*slot = pgd->next_free;
-		pgd->next_free = NULL;
+		uint64_t start = block_index(pgd) & ~(pages_per_block(PAGEBLOCK_ORDER) - 1);
+		uint64_t end = start + pages_per_block(PAGEBLOCK_ORDER);
+		if (end > _nr_page_descriptors) {
+			end = _nr_page_descriptors;
+		}
+
+		uint64_t index = start;
+		while (index < end) {
+			int order = _free_order[index];
+
+			if (order == NOT_FREE) {
+				index++;
+				continue;
+			}
+
+			unlink_block(&_page_descriptors[index], order, old_type);
+			link_block(&_page_descriptors[index], order, type);
+			index += pages_per_block(order);
+		}
+
+		_pageblock_type[start >> PAGEBLOCK_ORDER] = type;
 	}
 	
 	/**
-	 * Given a pointer to a block of free memory in the order "source_order", this function will
+	 * Given a block of free memory in the order "source_order", this function will
 	 * split the block in half, and insert it into the order below.
-	 * @param block_pointer A pointer to a pointer containing the beginning of a block of free memory.
+	 * @param block The first page descriptor of a block of free memory.
 	 * @param source_order The order in which the block of free memory exists.  Naturally,
 	 * the split will insert the two new blocks into the order below.
 	 * @return Returns the left-hand-side of the new block.
 	 */
-	PageDescriptor *split_block(PageDescriptor **block_pointer, int source_order)
+	PageDescriptor *split_block(PageDescriptor *block, int source_order)
 	{
-		// Make sure there is an incoming pointer.
-		//mm_log.messagef(LogLevel::DEBUG, "SPLITTING BLOCK:%p IN ORDER:%d",sys.mm().pgalloc().pgd_to_pfn(*block_pointer), source_order);
-		assert(*block_pointer);
+		// Make sure there is an incoming block.
+		assert(block);
 		
-		// Make sure the block_pointer is correctly aligned.
-		assert(is_correct_alignment_for_order(*block_pointer, source_order));
+		// Make sure the block is correctly aligned.
+		assert(is_correct_alignment_for_order(block, source_order));
 
 		//order to insert the blocks into
 		int upper_order = source_order-1;
 
-		// starting address of the first block is the same as the source block
-		PageDescriptor *block1 = *block_pointer;
-
 		//starting address of the second block  
-		PageDescriptor *block2 = buddy_of(block1, upper_order);
+		PageDescriptor *buddy = buddy_of(block, upper_order);
 		
 		//remove the block from the given order
-		remove_block(*block_pointer, source_order);
+		remove_block(block, source_order);
+		_stats.orders[source_order].splits++;
 
 		//insert both the new blocks into the upper order
-		insert_block(block1, upper_order);
-		insert_block(block2, upper_order);
+		insert_block(buddy, upper_order);
+		insert_block(block, upper_order);
 
-		return *block_pointer;		
+		return block;
 	}
 	
+	/**
+	 * Finds the free block that contains the given page, by checking the naturally aligned block
+	 * that would contain it in each order.
+	 * @param pgd The page descriptor of the page to look for.
+	 * @param order Populated with the order of the free block, if one is found.
+	 * @return Returns the first page descriptor of the free block containing the page, or NULL if
+	 * the page is not free.
+	 */
+	PageDescriptor *find_free_block(PageDescriptor *pgd, int *order)
+	{
+		uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+
+		for (int i = 0; i < MAX_ORDER; i++) {
+			PageDescriptor *block = pgd - (pfn % pages_per_block(i));
+
+			if (is_free_block(block, i)) {
+				*order = i;
+				return block;
+			}
+		}
+
+		return NULL;
+	}
+
 	/**
 	 * Takes a block in the given source order, and merges it (and it's buddy) into the next order.
 	 * This function assumes both the source block and the buddy block are in the free list for the
 	 * source order.  If they aren't this function will panic the system.
-	 * @param block_pointer A pointer to a pointer containing a block in the pair to merge.
+	 * @param block A block in the pair to merge.
 	 * @param source_order The order in which the pair of blocks live.
-	 * @return Returns the new slot that points to the merged block.
+	 * @return Returns the merged block.
 	 */
-	PageDescriptor **merge_block(PageDescriptor **block_pointer, int source_order)
+	PageDescriptor *merge_block(PageDescriptor *block, int source_order)
 	{
-		//mm_log.messagef(LogLevel::DEBUG, "MERGING BLOCK:%p IN ORDER:%d",*block_pointer,source_order);	
-		
-		// Make sure the area_pointer is correctly aligned.
-		assert(is_correct_alignment_for_order(*block_pointer, source_order)); 
+		// Make sure the block is correctly aligned.
+		assert(is_correct_alignment_for_order(block, source_order)); 
 
 		//pointer to the buddy block
-		PageDescriptor *buddy_pointer = buddy_of(*block_pointer, source_order);
-		//check that buddy is also correctly aligned
-
-		PageDescriptor* left_block = nullptr;
-		PageDescriptor* right_block = nullptr;
-		//whichever block address is smaller is the left hand one
-		if (*block_pointer > buddy_pointer ){
-			left_block = buddy_pointer;
-			right_block = *block_pointer;
-		}
-		else{
-			left_block = *block_pointer;
-			right_block = buddy_pointer;
-		}
-
-		//remove block overwites the pointer you give it so we need a copy of left_block for the insertion
-		PageDescriptor* left_cp = left_block;
-
-		
-		remove_block(left_block, source_order);
-		remove_block(right_block, source_order);
+		PageDescriptor *buddy = buddy_of(block, source_order);
 
-		return insert_block(left_cp, source_order+1) ;
+		remove_block(block, source_order);
+		remove_block(buddy, source_order);
+		_stats.orders[source_order].merges++;
 
+		//whichever block address is smaller is the left hand one, and is the start of the merged block
+		PageDescriptor *left_block = block < buddy ? block : buddy;
+		insert_block(left_block, source_order+1);
 
-				
+		return left_block;
 	}
 	
-public:
 	/**
-	 * Constructs a new instance of the Buddy Page Allocator.
+	 * Returns the number of DMA32 pages that are kept back from allocations that fall back from the
+	 * normal zone, so that devices that can only address the low 4GB are not starved.  The reserve is
+	 * in proportion to the size of the normal zone, so a machine with no memory above 4GB has none.
 	 */
-	BuddyPageAllocator() {
-		// Iterate over each free area, and clear it.
-		for (unsigned int i = 0; i < ARRAY_SIZE(_free_areas); i++) {
-			_free_areas[i] = NULL;
-		}
+	inline uint64_t lowmem_reserve() const
+	{
+		return _zone_managed_pages[Zone::NORMAL] / LOWMEM_RESERVE_RATIO;
 	}
-	
+
 	/**
-	 * Allocates 2^order number of contiguous pages
-	 * @param order The power of two, of the number of contiguous pages to allocate.
-	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
-	 * allocation failed.
+	 * Returns TRUE if a freed block may be held back in the hot page cache or the unmerged lists.
+	 * Those hand blocks straight out to normal allocations without checking the lowmem reserve, so
+	 * DMA32 blocks are only held back when there is no reserve to protect.
+	 * @param pgd The first page descriptor of the block being freed.
 	 */
-	PageDescriptor *alloc_pages(int order) override
+	inline bool may_hold_block(const PageDescriptor *pgd) const
 	{
-		//mm_log.messagef(LogLevel::DEBUG, "ALLOCATING PAGES IN ORDER:%d", order);
-
-		//container for the block to be allocated
-		PageDescriptor* block_allocated;
+		return page_zone(pgd) == Zone::NORMAL || !lowmem_reserve();
+	}
 
-		//check all orders starting from the given order and looking upwards to find and make a free
-		for (int i = order; i < MAX_ORDER;){
+	/**
+	 * Allocates a block of the given order directly from the free areas.  The requested zone is tried
+	 * first, followed by each zone below it.
+	 * @param order The order of the block to allocate.
+	 * @param type The migrate type of the allocation.
+	 * @param zone The preferred zone of the allocation.
+	 * @return Returns the first page descriptor of the allocated block, or NULL if there is no free
+	 * block large enough.
+	 */
+	PageDescriptor *alloc_block(int order, MigrateType::MigrateType type, Zone::Zone zone)
+	{
+		if (order < 0 || order >= MAX_ORDER) {
+			return NULL;
+		}
 
-			//pointer to a pointer to the address of the first free block in order i of _free_areas 
-			PageDescriptor **pgd = &_free_areas[i];
+		for (int i = zone; i >= 0; i--) {
+			Zone::Zone fallback = (Zone::Zone)i;
 
-			//mm_log.messagef(LogLevel::DEBUG, "LOOKING IN ORDER:%d", i);
-			//if no free pages exist in the current order then move to the greater one
-			if (*pgd == NULL){
-				i++;
+			// Falling back into a lower zone must leave that zone's reserve alone.
+			if (fallback != zone && _zone_free_pages[fallback] < pages_per_block(order) + lowmem_reserve()) {
+				continue;
 			}
-			else{
-				//mm_log.messagef(LogLevel::DEBUG, "FREE PAGE FOUND IN ORDER:%d", i);
-				//if a free page exists in the order you want then return the pgd of that page
-				if (i == order){
 
-					//remove_block overwrites the pgd its given so i need to save it before removing
-					block_allocated = *pgd;
-					remove_block(*pgd, i);
-					//mm_log.messagef(LogLevel::DEBUG, "ALLOCATING BLOCK:%p ORDER:%d", block_allocated, order);
-					return block_allocated;
-				}
-				// if a free page exists in a higher order then split the block and check the lower order
-				else{
-					split_block(pgd, i);
-					i--;
-				}
+			PageDescriptor *block = alloc_zone_block(order, type, fallback);
+			if (block) {
+				return block;
 			}
 		}
-		//if it gets to the end of this loop then return null
+
 		return NULL;
 	}
-	
+
 	/**
-	 * Frees 2^order contiguous pages.
-	 * @param pgd A pointer to an array of page descriptors to be freed.
-	 * @param order The power of two number of contiguous pages to free.
+	 * Allocates a block of the given order from a single zone.  If there is no free block large enough
+	 * of the requested migrate type, one is stolen from another type.
+	 * @param order The order of the block to allocate.
+	 * @param type The migrate type of the allocation.
+	 * @param zone The zone to allocate from.
+	 * @return Returns the first page descriptor of the allocated block, or NULL if there is no free
+	 * block large enough in the zone.
 	 */
-	void free_pages(PageDescriptor *pgd, int order) override
+	PageDescriptor *alloc_zone_block(int order, MigrateType::MigrateType type, Zone::Zone zone)
 	{
-		//mm_log.messagef(LogLevel::DEBUG, "FREEING PAGES STARTING FROM:%p ORDER:%d", sys.mm().pgalloc().pgd_to_pfn(pgd), order);
+		// Mask out the orders below the one requested, and pick the smallest of the remaining orders
+		// that has a free block.
+		uint32_t candidate_orders = _nonempty_orders[zone][type] & ~((1u << order) - 1);
+		if (!candidate_orders) {
+			return steal_block(order, type, zone);
+		}
 
-		// Make sure that the incoming page descriptor is correctly aligned
-		// for the order on which it is being freed, for example, it is
-		// illegal to free page 1 in order-1.	
-		assert(is_correct_alignment_for_order(pgd, order));
+		int source_order = __builtin_ctz(candidate_orders);
+		return take_block(_free_areas[zone][source_order][type], source_order, order);
+	}
 
-		//firstly free the given page
-		insert_block(pgd, order);
+	/**
+	 * Removes a free block from its free list, and splits it down to the given order.
+	 * @param block The first page descriptor of a free block.
+	 * @param source_order The order the block is free in.
+	 * @param order The order to split the block down to.
+	 * @return Returns the block, which is no longer free.
+	 */
+	PageDescriptor *take_block(PageDescriptor *block, int source_order, int order)
+	{
+		remove_block(block, source_order);
 
-		//check to see if buddy is also free
-		bool buddy_free = is_buddy_free(pgd, order);
-		
-		//if the buddy of the given pgd is free, then merge them and check the upper orders to see if they can also be merged
-		while(buddy_free && order<MAX_ORDER-1){
-			
-			PageDescriptor** new_block = merge_block(&pgd, order);
-			pgd = *new_block;
-			order++;
-			buddy_free = is_buddy_free(pgd, order);
+		// Split the block straight down to the requested order.  We keep the left-hand half each
+		// time, and the right-hand half goes back into the free list of the order below.
+		while (source_order > order) {
+			_stats.orders[source_order].splits++;
+			source_order--;
+			insert_block(block + pages_per_block(source_order), source_order);
 		}
+
+		return block;
 	}
 
 	/**
-	 *checks to see if the buddy of the given pgd is also free and in the same order,
-	 * 		returns true if yes, false otherwise
-	 * assumes the pgd is in _free_areas for the given order 
-	 * @param pgd pointer to the page to find the buddy off
-	 * @param order order to find the buddy in
+	 * Allocates a block for a migrate type that has run out of free blocks, by taking one from the
+	 * other migrate types.  The largest free block of any of them is taken, going by the fallback
+	 * order when there is a tie, so that as few pageblocks as possible end up holding a mix of types.  Large blocks are claimed for the new type
+	 * along with the rest of their pageblock, whereas small blocks are only borrowed.
+	 * @param order The order of the block to allocate.
+	 * @param type The migrate type of the allocation.
+	 * @param zone The zone to allocate from.
+	 * @return Returns the first page descriptor of the allocated block, or NULL if there is no free
+	 * block large enough in any migrate type.
 	 */
-	bool is_buddy_free(PageDescriptor* pgd, int order){
+	PageDescriptor *steal_block(int order, MigrateType::MigrateType type, Zone::Zone zone)
+	{
+		// Look at every fallback type before taking anything, so that a large block further down the
+		// fallback order is taken ahead of the leftovers in another type's pageblocks.
+		int source_order = -1;
+		MigrateType::MigrateType fallback = type;
 
-		
-		PageDescriptor *buddy = buddy_of(pgd, order);
-		//mm_log.messagef(LogLevel::DEBUG, "PFN:%p BUDDY_PFN:%p", sys.mm().pgalloc().pgd_to_pfn(pgd), sys.mm().pgalloc().pgd_to_pfn(buddy));
+		for (unsigned int i = 0; i < ARRAY_SIZE(migrate_fallbacks[type]); i++) {
+			uint32_t candidate_orders = _nonempty_orders[zone][migrate_fallbacks[type][i]] & ~((1u << order) - 1);
+			if (!candidate_orders) {
+				continue;
+			}
 
-		//since the buddies are next to each other we just need to check that at least
-		//one of them is next to the other
-		if ((pgd->next_free == buddy || buddy->next_free == pgd)){
-			return true;
+			int candidate_order = 31 - __builtin_clz(candidate_orders);
+			if (candidate_order > source_order) {
+				source_order = candidate_order;
+				fallback = migrate_fallbacks[type][i];
+			}
 		}
-		else{
-			return false;
-		}	
+
+		if (source_order < 0) {
+			return NULL;
+		}
+
+		PageDescriptor *block = _free_areas[zone][source_order][fallback];
+
+		// Small blocks are borrowed, and the rest of their pageblock keeps its type.
+		if (source_order < PAGEBLOCK_ORDER / 2) {
+			return take_block(block, source_order, order);
+		}
+
+		// Otherwise, claim pageblocks for this type.  A block bigger than what is needed is split
+		// down first, so that only the pageblocks that are needed change type.
+		int claim_order = order > PAGEBLOCK_ORDER ? order : PAGEBLOCK_ORDER;
+		if (source_order >= claim_order) {
+			take_block(block, source_order, claim_order);
+
+			uint64_t first_pageblock = block_index(block) >> PAGEBLOCK_ORDER;
+			for (uint64_t j = 0; j < pages_per_block(claim_order - PAGEBLOCK_ORDER); j++) {
+				_pageblock_type[first_pageblock + j] = type;
+			}
+
+			insert_block(block, claim_order);
+		} else {
+			set_pageblock_type(block, type);
+		}
+
+		// The free lists for this type now have a block large enough.
+		return alloc_zone_block(order, type, zone);
 	}
-	
+
 	/**
-	 * Reserves a specific page, so that it cannot be allocated.
-	 * @param pgd The page descriptor of the page to reserve.
-	 * @return Returns TRUE if the reservation was successful, FALSE otherwise.
+	 * Takes a free block of order "block_order", hands out as many blocks of order "order" from the
+	 * start of it as are wanted, and returns whatever is left over to the free areas.
+	 * @param block The first page descriptor of the block to carve up.  It must not be in a free list.
+	 * @param block_order The order of the block being carved up.
+	 * @param order The order of the blocks to hand out.
+	 * @param wanted The number of blocks that are wanted.
+	 * @param out The array to store the handed out blocks in.
+	 * @return Returns the number of blocks handed out, which is at most the number of blocks of the
+	 * given order that fit in the block being carved up.
 	 */
-	bool reserve_page(PageDescriptor *pgd)
+	unsigned int carve_block(PageDescriptor *block, int block_order, int order, unsigned int wanted, PageDescriptor **out)
 	{
-		//mm_log.messagef(LogLevel::DEBUG, "RESERVING PAGE:%p", sys.mm().pgalloc().pgd_to_pfn(pgd));
+		unsigned int carved = 0;
 
-		// order to start searching from
-		int order = MAX_ORDER-1;
+		while (true) {
+			uint64_t blocks = pages_per_block(block_order - order);
 
-		//container for pa
-		PageDescriptor* block_with_page ;
-		bool page_reserved = false;
-
-		//this nested loop goes through every block in every order in _free_areas to find the block the required page is in, starting from the hightest order
-		//when it finds the block the page is in, it splits it and cmoves on to the lower one
-		//by the end of this the page will be in the lowest order and will be ava
-		while(order >0){
-			//mm_log.messagef(LogLevel::DEBUG, "CHECKING BLOCK:%p IN ORDER:%d", sys.mm().pgalloc().pgd_to_pfn(*slot), order);
-			
-			PageDescriptor **block = &_free_areas[order];
-			
-			//while there is still a free block to check 
-			while(*block){
-				
-				//if the page is within in the block we are looking at then split the block
-				if (pgd >= *block && pgd < *block+pages_per_block(order)){
-					//mm_log.messagef(LogLevel::DEBUG, "PFN:%p",sys.mm().pgalloc().pgd_to_pfn(pgd));
-					//mm_log.messagef(LogLevel::DEBUG, "PAGE FOUND IN BLOCK:%p", sys.mm().pgalloc().pgd_to_pfn(*slot));
-
-					split_block(block, order);					
+			// If everything that is left of the block is wanted, hand all of it out.
+			if (wanted - carved >= blocks) {
+				for (uint64_t i = 0; i < blocks; i++) {
+					out[carved++] = block + i * pages_per_block(order);
 				}
-				//else, look at the next slot
-				else{
-					//mm_log.messagef(LogLevel::DEBUG, "PAGE NOT FOUND, CHECKING BLOCK:%p",sys.mm().pgalloc().pgd_to_pfn(*slot) );
 
-					block = &(*block)->next_free;
-					
-				}
+				return carved;
+			}
 
+			// If nothing more is wanted, what is left of the block goes back to the free areas.
+			if (wanted == carved) {
+				insert_block(block, block_order);
+				return carved;
 			}
-			//mm_log.messagef(LogLevel::DEBUG, "PAGE NOT FOUND IN ORDER:%d CHECKING ORDER:%d",order, order-1);
 
-			//regardless of whether or not the block is found or not, we move on to the next order
-			order--;
+			// Otherwise, split the block.  If the whole left-hand half is wanted, hand it out and carry
+			// on with the right-hand half.  If not, the right-hand half goes back to the free areas.
+			_stats.orders[block_order].splits++;
+			block_order--;
+			PageDescriptor *right_block = block + pages_per_block(block_order);
 
-			//if we are now in the lowest order then the page is available to be reserved
-			if (order==0) {
-				page_reserved = true;
-			}	
-		}
+			if (wanted - carved >= blocks / 2) {
+				for (uint64_t i = 0; i < blocks / 2; i++) {
+					out[carved++] = block + i * pages_per_block(order);
+				}
 
-		if(page_reserved = true){
-			remove_block(pgd, 0);
+				block = right_block;
+			} else {
+				insert_block(right_block, block_order);
+			}
 		}
-		return page_reserved;
-		
-	} 
-
+	}
 
 	/**
-	 * Initialises the allocation algorithm.
-	 * @param page_descriptors pgd to start allocating from
-	 * @param nr_page_descriptors number of pages in the system
-	 * @return Returns TRUE if the algorithm was successfully initialised, FALSE otherwise.
+	 * Carves blocks out of the free blocks of a migrate type, for a bulk allocation.  The requested
+	 * zone is tried first, followed by each zone below it, as far as that zone's lowmem reserve allows.
+	 * @param order The order of the blocks to hand out.
+	 * @param wanted The number of blocks that are wanted.
+	 * @param out The array to store the handed out blocks in.
+	 * @param type The migrate type of the allocation.
+	 * @param zone The preferred zone of the allocation.
+	 * @return Returns the number of blocks handed out, which is less than "wanted" once the free
+	 * blocks of this type run out in every zone that may be used.
 	 */
-	bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) override
+	unsigned int carve_zones(int order, unsigned int wanted, PageDescriptor **out, MigrateType::MigrateType type, Zone::Zone zone)
 	{
-		mm_log.messagef(LogLevel::DEBUG, "Buddy Allocator Initialising pd=%p, nr=0x%lx", page_descriptors, nr_page_descriptors);
-		
-		// Initialise the free area linked list for the maximum order
-		// to initialise the allocation algorithm.
+		unsigned int carved = 0;
+
+		for (int i = zone; i >= 0 && carved < wanted; i--) {
+			Zone::Zone fallback = (Zone::Zone)i;
+
+			while (carved < wanted) {
+				uint32_t candidate_orders = _nonempty_orders[fallback][type] & ~((1u << order) - 1);
+				if (!candidate_orders) {
+					break;
+				}
+
+				// Falling back into a lower zone must leave that zone's reserve alone.
+				uint64_t allowed = wanted - carved;
+				if (fallback != zone) {
+					uint64_t reserve = lowmem_reserve();
+					uint64_t spare = _zone_free_pages[fallback] > reserve ? (_zone_free_pages[fallback] - reserve) >> order : 0;
+
+					if (spare < allowed) {
+						allowed = spare;
+					}
 
-		int blocks_in_MAX_ORDER = nr_page_descriptors/pages_per_block(MAX_ORDER-1);
+					if (!allowed) {
+						break;
+					}
+				}
+
+				// Work out the order of a block that would hold everything that is still wanted, and take
+				// the smallest free block at least that big.  If there isn't one, take the largest free block.
+				int wanted_order = order;
+				while (wanted_order < MAX_ORDER - 1 && pages_per_block(wanted_order - order) < allowed) {
+					wanted_order++;
+				}
+
+				uint32_t large_orders = candidate_orders & ~((1u << wanted_order) - 1);
+				int source_order = large_orders ? __builtin_ctz(large_orders) : 31 - __builtin_clz(candidate_orders);
 
-		//puts all the blocks into the max order that it can, ignores the left over ones
-		for (int i = 0; i < blocks_in_MAX_ORDER; i++){
-			insert_block(page_descriptors, MAX_ORDER-1);
-			page_descriptors += pages_per_block(MAX_ORDER-1);
+				PageDescriptor *block = _free_areas[fallback][source_order][type];
+				remove_block(block, source_order);
+
+				carved += carve_block(block, source_order, order, (unsigned int)allowed, &out[carved]);
+			}
 		}
-		return true;
+
+		return carved;
 	}
 
 	/**
-	 * Returns the friendly name of the allocation algorithm, for debugging and selection purposes.
+	 * Returns a block to the free areas, merging it with its buddy for as many orders as possible.
+	 * @param pgd The first page descriptor of the block to free.
+	 * @param order The order of the block.
 	 */
-	const char* name() const override { return "buddy"; }
-	
+	void free_block(PageDescriptor *pgd, int order)
+	{
+		//firstly free the given page
+		insert_block(pgd, order);
+
+		coalesce_block(pgd, order);
+	}
+
 	/**
-	 * Dumps out the current state of the buddy system
+	 * Merges a free block with its buddy for as many orders as possible.
+	 * @param pgd The first page descriptor of a block in the free list of the given order.
+	 * @param order The order the block is free in.
 	 */
-	void dump_state() const override
+	void coalesce_block(PageDescriptor *pgd, int order)
 	{
-		// Print out a header, so we can find the output in the logs.
-		mm_log.messagef(LogLevel::DEBUG, "BUDDY STATE:");
+		//check to see if buddy is also free
+		bool buddy_free = is_buddy_free(pgd, order);
 		
-		// Iterate over each free area.
-		for (unsigned int i = 0; i < ARRAY_SIZE(_free_areas); i++) {
-			char buffer[256];
-			snprintf(buffer, sizeof(buffer), "[%d] ", i);
-						
-			// Iterate over each block in the free area.
-			PageDescriptor *pg = _free_areas[i];
-			while (pg) {
-				// Append the PFN of the free block to the output buffer.
-				snprintf(buffer, sizeof(buffer), "%s%lx ", buffer, sys.mm().pgalloc().pgd_to_pfn(pg));
-				pg = pg->next_free;
-			}
+		//if the buddy of the given pgd is free, then merge them and check the upper orders to see if they can also be merged
+		while(buddy_free && order<MAX_ORDER-1){
 			
-			mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
+			pgd = merge_block(pgd, order);
+			order++;
+			buddy_free = is_buddy_free(pgd, order);
+		}
+	}
+
+	/**
+	 * Allocates a single page from the hot page cache, refilling the cache from the free areas
+	 * if it is empty.
+	 * @return Returns the page descriptor of the allocated page, or NULL if there are no free pages.
+	 */
+	PageDescriptor *alloc_hot_page()
+	{
+		if (!_hot_pages.count) {
+			refill_hot_pages();
+
+			if (!_hot_pages.count) {
+				return NULL;
+			}
+		}
+
+		PageDescriptor *pgd = _hot_pages.head;
+		_hot_pages.head = pgd->next_free;
+		_hot_pages.count--;
+
+		pgd->next_free = NULL;
+		return pgd;
+	}
+
+	/**
+	 * Puts a single page on the hot page cache, draining a batch back to the free areas if the cache
+	 * has grown past its high watermark.
+	 * @param pgd The page descriptor of the page being freed.
+	 */
+	void free_hot_page(PageDescriptor *pgd)
+	{
+		pgd->next_free = _hot_pages.head;
+		_hot_pages.head = pgd;
+		_hot_pages.count++;
+
+		if (_hot_pages.count > PCP_HIGH) {
+			drain_hot_pages(PCP_LOW);
+		}
+	}
+
+	/**
+	 * Moves a batch of pages from the free areas into the hot page cache.
+	 */
+	void refill_hot_pages()
+	{
+		for (unsigned int i = 0; i < PCP_BATCH; i++) {
+			PageDescriptor *pgd = alloc_block(0, MigrateType::UNMOVABLE, Zone::NORMAL);
+			if (!pgd) {
+				break;
+			}
+
+			pgd->next_free = _hot_pages.head;
+			_hot_pages.head = pgd;
+			_hot_pages.count++;
+		}
+	}
+
+	/**
+	 * Returns pages from the hot page cache to the free areas, until the cache holds no more than
+	 * the given number of pages.
+	 * @param target The number of pages to leave in the cache.
+	 */
+	void drain_hot_pages(unsigned int target)
+	{
+		while (_hot_pages.count > target) {
+			PageDescriptor *pgd = _hot_pages.head;
+			_hot_pages.head = pgd->next_free;
+			_hot_pages.count--;
+
+			free_block(pgd, 0);
+		}
+	}
+
+	/**
+	 * Allocates a block of the given order from the blocks that have been freed but not yet merged.
+	 * @param order The order of the block to allocate.
+	 * @param type The migrate type of the allocation.
+	 * @return Returns the first page descriptor of the block, or NULL if there is no unmerged block of
+	 * exactly this order and type.
+	 */
+	PageDescriptor *alloc_unmerged_block(int order, MigrateType::MigrateType type)
+	{
+		PageDescriptor *pgd = _unmerged[order][type];
+		if (!pgd) {
+			return NULL;
+		}
+
+		_unmerged[order][type] = pgd->next_free;
+		_nr_unmerged--;
+
+		pgd->next_free = NULL;
+		return pgd;
+	}
+
+	/**
+	 * Puts a freed block on the unmerged list for its order, without merging it with its buddy.  If too
+	 * many blocks are waiting to be merged, they are all merged.
+	 * @param pgd The first page descriptor of the block being freed.
+	 * @param order The order of the block.
+	 */
+	void free_unmerged_block(PageDescriptor *pgd, int order)
+	{
+		MigrateType::MigrateType type = pageblock_type(pgd);
+
+		pgd->next_free = _unmerged[order][type];
+		_unmerged[order][type] = pgd;
+		_nr_unmerged++;
+
+		if (_nr_unmerged > UNMERGED_HIGH) {
+			coalesce_unmerged();
+		}
+	}
+
+	/**
+	 * Returns every block on the unmerged lists to the free areas, merging them as it goes.
+	 */
+	void coalesce_unmerged()
+	{
+		for (unsigned int i = 0; i < ARRAY_SIZE(_unmerged); i++) {
+			for (unsigned int j = 0; j < ARRAY_SIZE(_unmerged[i]); j++) {
+				while (_unmerged[i][j]) {
+					PageDescriptor *pgd = _unmerged[i][j];
+					_unmerged[i][j] = pgd->next_free;
+
+					free_block(pgd, i);
+				}
+			}
+		}
+
+		_nr_unmerged = 0;
+	}
+
+	/**
+	 * Allocates a block of the given order, from the hot page cache or the unmerged lists if it can
+	 * be served from them, or from the free areas otherwise.  Nothing is counted in the statistics.
+	 * @param order The order of the block to allocate.
+	 * @param type The migrate type of the allocation.
+	 * @param zone The preferred zone of the allocation.
+	 * @return Returns the first page descriptor of the allocated block, or NULL if there is no free
+	 * block large enough outside of the pages being held back.
+	 */
+	PageDescriptor *take_pages(int order, MigrateType::MigrateType type, Zone::Zone zone)
+	{
+		PageDescriptor *block;
+
+		// Single unmovable pages are served from the hot page cache.  Otherwise, a block of exactly
+		// this order that was freed without merging needs no splitting.  Both of these only hold DMA32
+		// pages that a normal allocation may fall back to, so DMA32 allocations go straight to the
+		// free areas.
+		bool use_hot_pages = order == 0 && type == MigrateType::UNMOVABLE && zone == Zone::NORMAL;
+		if (use_hot_pages) {
+			block = alloc_hot_page();
+		} else {
+			block = zone == Zone::NORMAL ? alloc_unmerged_block(order, type) : NULL;
+
+			if (!block) {
+				block = alloc_block(order, type, zone);
+			}
+		}
+
+		return block;
+	}
+
+	/**
+	 * Frees a block to wherever it is best kept: the hot page cache, the unmerged lists or the free
+	 * areas.  Nothing is counted in the statistics.
+	 * @param pgd The first page descriptor of the block to free.
+	 * @param order The order of the block.
+	 */
+	void put_pages(PageDescriptor *pgd, int order)
+	{
+		// Single unmovable pages go back to the hot page cache, which hands them back to the free
+		// areas in batches once it grows too large.  In lazy coalescing mode, other blocks are left
+		// unmerged until they are needed to form a larger block.  DMA32 blocks that the lowmem
+		// reserve protects go straight back to the free areas.
+		if (!may_hold_block(pgd)) {
+			free_block(pgd, order);
+		} else if (order == 0 && pageblock_type(pgd) == MigrateType::UNMOVABLE) {
+			free_hot_page(pgd);
+		} else if (_lazy_coalescing) {
+			free_unmerged_block(pgd, order);
+		} else {
+			free_block(pgd, order);
+		}
+	}
+
+	/**
+	 * Allocates a block for the benchmark, without counting it in the statistics or releasing held
+	 * back pages to make room for it.
+	 * @param order The order of the block to allocate.
+	 */
+	PageDescriptor *bench_alloc(int order)
+	{
+		UniqueSpinLock l(_lock);
+		ensure_built();
+
+		return take_pages(order, MigrateType::UNMOVABLE, Zone::NORMAL);
+	}
+
+	/**
+	 * Frees a block allocated with bench_alloc(), without counting it in the statistics.
+	 * @param pgd The first page descriptor of the block.
+	 * @param order The order of the block.
+	 */
+	void bench_free(PageDescriptor *pgd, int order)
+	{
+		UniqueSpinLock l(_lock);
+		put_pages(pgd, order);
+	}
+
+	/**
+	 * Returns every page held back in the hot page cache or on the unmerged lists to the free areas.
+	 * @return Returns TRUE if any pages were returned, FALSE otherwise.
+	 */
+	bool release_held_pages()
+	{
+		if (!_hot_pages.count && !_nr_unmerged && !_nr_zero_pages) {
+			return false;
+		}
+
+		drain_hot_pages(0);
+		coalesce_unmerged();
+
+		while (_zero_pool) {
+			PageDescriptor *pgd = _zero_pool;
+			_zero_pool = pgd->next_free;
+
+			free_block(pgd, 0);
+		}
+
+		_nr_zero_pages = 0;
+		return true;
+	}
+
+	/**
+	 * Zeroes the memory of a block, using non-temporal stores so that the zeroes do not displace
+	 * anything useful from the caches.
+	 * @param pgd The first page descriptor of the block to zero.
+	 * @param order The order of the block.
+	 */
+	static void zero_block(PageDescriptor *pgd, int order)
+	{
+		uint64_t *words = (uint64_t *)sys.mm().pgalloc().pgd_to_vpa(pgd);
+		uint64_t nr_words = pages_per_block(order) * (PAGE_BYTES / sizeof(uint64_t));
+
+		for (uint64_t i = 0; i < nr_words; i++) {
+			asm volatile("movnti %1, %0" : "=m"(words[i]) : "r"((uint64_t)0));
+		}
+
+		// Non-temporal stores are weakly ordered, so make sure they are all visible before the pages
+		// are handed out.
+		asm volatile("sfence" ::: "memory");
+	}
+	
+	/**
+	 * Makes a range of pages available for allocation, in a single pass over the range.
+	 * @param start The page descriptor of the first page in the range.
+	 * @param count The number of pages in the range.
+	 */
+	void insert_range(PageDescriptor *start, uint64_t count)
+	{
+		// Ignore any part of the range that lies outside of the pages being managed.
+		uint64_t index = block_index(start);
+		if (index >= _nr_page_descriptors) {
+			return;
+		}
+
+		if (count > _nr_page_descriptors - index) {
+			count = _nr_page_descriptors - index;
+		}
+
+		uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(start);
+
+		while (count) {
+			// Find the largest block that is aligned at this page frame and fits in the rest of the range.
+			int order = MAX_ORDER - 1;
+			while (order > 0 && ((pfn % pages_per_block(order)) != 0 || pages_per_block(order) > count)) {
+				order--;
+			}
+
+			// Blocks at the edges of the range may have free buddies in a neighbouring range.
+			free_block(start, order);
+			_zone_managed_pages[page_zone(start)] += pages_per_block(order);
+
+			start += pages_per_block(order);
+			pfn += pages_per_block(order);
+			count -= pages_per_block(order);
+		}
+	}
+
+	/**
+	 * Returns TRUE if a page has been reserved, before the free areas are built.
+	 */
+	static inline bool is_marked_reserved(const PageDescriptor *pgd)
+	{
+		return pgd->next_free == pgd;
+	}
+
+	/**
+	 * Marks a range of pages as reserved, before the free areas are built.  A reserved page points to
+	 * itself through next_free, which no free list can do.
+	 * @param first_pfn The page frame number of the first page to reserve.
+	 * @param count The number of pages to reserve.
+	 * @return Returns TRUE if none of the pages were reserved already, FALSE otherwise.
+	 */
+	bool mark_reserved(uint64_t first_pfn, uint64_t count)
+	{
+		bool reserved_all = true;
+
+		for (uint64_t pfn = first_pfn; pfn < first_pfn + count; pfn++) {
+			PageDescriptor *pgd = sys.mm().pgalloc().pfn_to_pgd(pfn);
+			if (block_index(pgd) >= _nr_page_descriptors) {
+				continue;
+			}
+
+			if (is_marked_reserved(pgd)) {
+				reserved_all = false;
+			}
+
+			pgd->next_free = pgd;
+		}
+
+		return reserved_all;
+	}
+
+	/**
+	 * Builds the free areas, if they have not been built yet.  Must be called with the lock held, by
+	 * every entry point that uses them.
+	 */
+	inline void ensure_built()
+	{
+		if (!_built) {
+			build_free_areas();
+		}
+	}
+
+	/**
+	 * Sets up the per-page free state, and puts every page that has not been reserved into the free
+	 * areas.  The free state takes about five bytes per page, which is carved out of the highest run
+	 * of unreserved pages that is long enough, so that it is sized to the machine and does not use
+	 * up low memory.
+	 */
+	void build_free_areas()
+	{
+		_built = true;
+
+		uint64_t nr_pages = _nr_page_descriptors;
+		uint64_t nr_pageblocks = (nr_pages + pages_per_block(PAGEBLOCK_ORDER) - 1) >> PAGEBLOCK_ORDER;
+		uint64_t metadata_bytes = nr_pages * (sizeof(*_prev_free) + sizeof(*_free_order)) + nr_pageblocks * sizeof(*_pageblock_type);
+		uint64_t metadata_pages = (metadata_bytes + PAGE_BYTES - 1) / PAGE_BYTES;
+
+		// Look for the highest run of unreserved pages that the free state fits in.
+		uint64_t run = 0, index = nr_pages;
+		while (index > 0 && run < metadata_pages) {
+			index--;
+			run = is_marked_reserved(&_page_descriptors[index]) ? 0 : run + 1;
+		}
+
+		if (run < metadata_pages) {
+			mm_log.messagef(LogLevel::ERROR, "Buddy Allocator has no room for 0x%lx pages of free state", metadata_pages);
+			_nr_page_descriptors = 0;
+			return;
+		}
+
+		// The pages of the run are contiguous in the kernel's mapping of physical memory.
+		uint8_t *metadata = (uint8_t *)sys.mm().pgalloc().pgd_to_vpa(&_page_descriptors[index]);
+		_prev_free = (uint32_t *)metadata;
+		_free_order = (int8_t *)(metadata + nr_pages * sizeof(*_prev_free));
+		_pageblock_type = (uint8_t *)(_free_order + nr_pages);
+
+		mark_reserved(sys.mm().pgalloc().pgd_to_pfn(&_page_descriptors[index]), metadata_pages);
+		mm_log.messagef(LogLevel::DEBUG, "Buddy Allocator free state is 0x%lx pages from index 0x%lx", metadata_pages, index);
+
+		// No page starts a free block until it is inserted into a free area.
+		for (uint64_t i = 0; i < nr_pages; i++) {
+			_prev_free[i] = NO_PREV;
+			_free_order[i] = NOT_FREE;
+		}
+
+		// All memory starts off unmovable, which is what the untyped alloc_pages() asks for, and
+		// pageblocks are claimed by the other types as they need them.
+		for (uint64_t i = 0; i < nr_pageblocks; i++) {
+			_pageblock_type[i] = MigrateType::UNMOVABLE;
+		}
+
+		// Insert each run of pages between reserved pages, and clear the reservation marks.
+		uint64_t start = 0;
+		for (uint64_t i = 0; i <= nr_pages; i++) {
+			if (i < nr_pages && !is_marked_reserved(&_page_descriptors[i])) {
+				continue;
+			}
+
+			if (i > start) {
+				insert_range(&_page_descriptors[start], i - start);
+			}
+
+			if (i < nr_pages) {
+				_page_descriptors[i].next_free = NULL;
+			}
+
+			start = i + 1;
+		}
+	}
+
+public:
+	/**
+	 * Counters for a single order.  Apart from free_blocks, these count events since boot.
+	 */
+	struct OrderStats {
+		uint64_t allocs;
+		uint64_t frees;
+		uint64_t splits;
+		uint64_t merges;
+		uint64_t failures;
+		uint64_t free_blocks;
+	};
+
+	/**
+	 * Statistics for the whole allocator.  Bucket N of a latency histogram counts the operations that
+	 * took between 2^N and 2^(N+1) cycles.
+	 */
+	struct AllocatorStats {
+		OrderStats orders[MAX_ORDER];
+		uint64_t alloc_latency[LATENCY_BUCKETS];
+		uint64_t free_latency[LATENCY_BUCKETS];
+	};
+
+	/**
+	 * Constructs a new instance of the Buddy Page Allocator.
+	 */
+	BuddyPageAllocator() {
+		// Iterate over each zone, and clear its free areas.
+		for (unsigned int i = 0; i < ARRAY_SIZE(_free_areas); i++) {
+			for (unsigned int j = 0; j < ARRAY_SIZE(_free_areas[i]); j++) {
+				for (unsigned int k = 0; k < ARRAY_SIZE(_free_areas[i][j]); k++) {
+					_free_areas[i][j][k] = NULL;
+				}
+			}
+
+			for (unsigned int j = 0; j < ARRAY_SIZE(_nonempty_orders[i]); j++) {
+				_nonempty_orders[i][j] = 0;
+			}
+
+			_zone_free_pages[i] = 0;
+			_zone_managed_pages[i] = 0;
+		}
+
+		_hot_pages.head = NULL;
+		_hot_pages.count = 0;
+		_stats = AllocatorStats();
+
+		for (unsigned int i = 0; i < ARRAY_SIZE(_unmerged); i++) {
+			for (unsigned int j = 0; j < ARRAY_SIZE(_unmerged[i]); j++) {
+				_unmerged[i][j] = NULL;
+			}
+		}
+
+		_nr_unmerged = 0;
+		_lazy_coalescing = false;
+		_zero_pool = NULL;
+		_nr_zero_pages = 0;
+		_page_descriptors = NULL;
+		_nr_page_descriptors = 0;
+		_built = false;
+		_benchmark_pending = false;
+		_prev_free = NULL;
+		_free_order = NULL;
+		_pageblock_type = NULL;
+	}
+
+	~BuddyPageAllocator()
+	{
+		if (buddy_allocator == this) {
+			buddy_allocator = NULL;
+		}
+	}
+	
+	/**
+	 * Allocates 2^order number of contiguous pages
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *alloc_pages(int order) override
+	{
+		// The free areas are only filled in after init(), so a benchmark asked for on the command
+		// line is run on the first allocation instead.
+		if (_benchmark_pending && __atomic_exchange_n(&_benchmark_pending, false, __ATOMIC_RELAXED)) {
+			run_benchmark(BENCH_MAX_ORDER, BENCH_ROUNDS);
+		}
+
+		return alloc_pages(order, MigrateType::UNMOVABLE);
+	}
+
+	/**
+	 * Allocates 2^order number of contiguous pages, of the given migrate type.  Allocations of each
+	 * type are grouped together in pageblocks, so that long-lived unmovable pages do not end up
+	 * scattered across every large block.  No kernel code calls this with anything but the unmovable
+	 * type yet, so the grouping only starts to matter once a caller asks for movable or reclaimable
+	 * pages here.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @param type The migrate type of the allocation.
+	 * @param zone The preferred zone of the allocation.  Normal allocations fall back to DMA32 memory
+	 * once normal memory runs out, but DMA32 allocations never get normal memory.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *alloc_pages(int order, MigrateType::MigrateType type, Zone::Zone zone = Zone::NORMAL)
+	{
+		UniqueSpinLock l(_lock);
+		ensure_built();
+
+		if (order < 0 || order >= MAX_ORDER) {
+			return NULL;
+		}
+
+		uint64_t start = read_cycle_counter();
+		PageDescriptor *block = take_pages(order, type, zone);
+
+		// The hot page cache or the unmerged lists may be holding on to the pages needed to form a
+		// block of this order, so hand them back to the free areas and try again.
+		if (!block && release_held_pages()) {
+			block = take_pages(order, type, zone);
+		}
+
+		if (block) {
+			_stats.orders[order].allocs++;
+		} else {
+			_stats.orders[order].failures++;
+		}
+
+		record_latency(_stats.alloc_latency, read_cycle_counter() - start);
+		return block;
+	}
+	
+	/**
+	 * Frees 2^order contiguous pages.  While the zeroed page pool is low, a freed single page is
+	 * zeroed and added to it, so that the pool is kept topped up even if nothing calls
+	 * refill_zero_pool().  That costs the caller one page of zeroing, done before the lock is taken.
+	 * @param pgd A pointer to an array of page descriptors to be freed.
+	 * @param order The power of two number of contiguous pages to free.
+	 */
+	void free_pages(PageDescriptor *pgd, int order) override
+	{
+		// The pool is checked again once the lock is held, so a racy read is enough to decide.
+		bool zeroed = order == 0 && __atomic_load_n(&_nr_zero_pages, __ATOMIC_RELAXED) < ZERO_POOL_LOW;
+		if (zeroed) {
+			zero_block(pgd, 0);
+		}
+
+		UniqueSpinLock l(_lock);
+		ensure_built();
+
+		// Make sure that the incoming page descriptor is correctly aligned
+		// for the order on which it is being freed, for example, it is
+		// illegal to free page 1 in order-1.	
+		assert(is_correct_alignment_for_order(pgd, order));
+
+		uint64_t start = read_cycle_counter();
+
+		if (zeroed && _nr_zero_pages < ZERO_POOL_HIGH) {
+			pgd->next_free = _zero_pool;
+			_zero_pool = pgd;
+			_nr_zero_pages++;
+		} else {
+			put_pages(pgd, order);
+		}
+
+		_stats.orders[order].frees++;
+		record_latency(_stats.free_latency, read_cycle_counter() - start);
+	}
+
+	/**
+	 * Allocates up to "count" blocks of 2^order contiguous pages.  As many blocks as possible are carved
+	 * out of each free block taken from the free areas, so the order search and splitting is done once
+	 * per large block rather than once per allocation.
+	 * @param order The power of two, of the number of contiguous pages in each block.
+	 * @param count The number of blocks to allocate.
+	 * @param out An array of at least "count" entries, which is filled with the allocated blocks.
+	 * @param type The migrate type of the allocation.
+	 * @param zone The preferred zone of the allocation.
+	 * @return Returns the number of blocks allocated, which is less than "count" if memory ran out.
+	 */
+	unsigned int alloc_pages_bulk(int order, unsigned int count, PageDescriptor **out,
+		MigrateType::MigrateType type = MigrateType::UNMOVABLE, Zone::Zone zone = Zone::NORMAL)
+	{
+		UniqueSpinLock l(_lock);
+		ensure_built();
+
+		if (order < 0 || order >= MAX_ORDER) {
+			return 0;
+		}
+
+		unsigned int allocated = 0;
+		while (allocated < count) {
+			allocated += carve_zones(order, count - allocated, &out[allocated], type, zone);
+			if (allocated == count) {
+				break;
+			}
+
+			// If this type has run dry in every zone it may use, allocate one block at a time, so that
+			// blocks are stolen from the other types.  If the free areas have run dry altogether, the
+			// hot page cache or the unmerged lists may still be holding free pages.
+			PageDescriptor *block = alloc_block(order, type, zone);
+			if (block) {
+				out[allocated++] = block;
+				continue;
+			}
+
+			if (!release_held_pages()) {
+				break;
+			}
+		}
+
+		_stats.orders[order].allocs += allocated;
+		if (allocated < count) {
+			_stats.orders[order].failures++;
+		}
+
+		return allocated;
+	}
+
+	/**
+	 * Frees "count" blocks of 2^order contiguous pages.  The whole batch is returned to the free areas
+	 * before any merging is done, and then merged in a single sweep.
+	 * @param pgds An array of the first page descriptors of the blocks to free.
+	 * @param count The number of blocks to free.
+	 * @param order The power of two number of contiguous pages in each block.
+	 */
+	void free_pages_bulk(PageDescriptor **pgds, unsigned int count, int order)
+	{
+		UniqueSpinLock l(_lock);
+		ensure_built();
+
+		for (unsigned int i = 0; i < count; i++) {
+			assert(is_correct_alignment_for_order(pgds[i], order));
+			insert_block(pgds[i], order);
+		}
+
+		// A block will no longer be free in this order if it has already been merged with a buddy
+		// from earlier in the batch.
+		for (unsigned int i = 0; i < count; i++) {
+			if (is_free_block(pgds[i], order)) {
+				coalesce_block(pgds[i], order);
+			}
+		}
+
+		_stats.orders[order].frees += count;
+	}
+
+	/**
+	 *checks to see if the buddy of the given pgd is also free and in the same order,
+	 * 		returns true if yes, false otherwise
+	 * @param pgd pointer to the page to find the buddy off
+	 * @param order order to find the buddy in
+	 */
+	bool is_buddy_free(PageDescriptor* pgd, int order){
+
+		PageDescriptor *buddy = buddy_of(pgd, order);
+
+		//the buddy is free if it is the head of a free block in exactly this order
+		return buddy && is_free_block(buddy, order);
+	}
+	
+	/**
+	 * Reserves a specific page, so that it cannot be allocated.
+	 * @param pgd The page descriptor of the page to reserve.
+	 * @return Returns TRUE if the reservation was successful, FALSE otherwise.
+	 */
+	bool reserve_page(PageDescriptor *pgd)
+	{
+		return reserve_range(sys.mm().pgalloc().pgd_to_pfn(pgd), 1);
+	}
+
+	/**
+	 * Reserves a range of pages, so that they cannot be allocated.  For each part of the range, the
+	 * free block containing it is found directly from the page frame number, and only the blocks on
+	 * the path down to the range are split.  Aligned blocks that lie entirely inside the range are
+	 * reserved in one step.
+	 * @param first_pfn The page frame number of the first page to reserve.
+	 * @param count The number of pages to reserve.
+	 * @return Returns TRUE if every page in the range was reserved, or FALSE if some of the pages were
+	 * not free.  The free pages in the range are reserved either way.
+	 */
+	bool reserve_range(uint64_t first_pfn, uint64_t count)
+	{
+		UniqueSpinLock l(_lock);
+
+		// Until the free areas are built, reserved pages are just marked, and left out when they are.
+		if (!_built) {
+			return mark_reserved(first_pfn, count);
+		}
+
+		// Pages in the range may be sitting in the hot page cache or on the unmerged lists, so make
+		// sure every free page is back in the free areas first.
+		release_held_pages();
+
+		bool reserved_all = true;
+		uint64_t pfn = first_pfn;
+		uint64_t end_pfn = first_pfn + count;
+
+		while (pfn < end_pfn) {
+			int order;
+			PageDescriptor *block = find_free_block(sys.mm().pgalloc().pfn_to_pgd(pfn), &order);
+
+			// The page is already allocated or reserved, so move on to the next one.
+			if (!block) {
+				reserved_all = false;
+				pfn++;
+				continue;
+			}
+
+			// Split the block until it lies entirely inside the range, keeping the half that contains
+			// the page we are looking at.
+			uint64_t block_pfn = sys.mm().pgalloc().pgd_to_pfn(block);
+			while (block_pfn < pfn || block_pfn + pages_per_block(order) > end_pfn) {
+				split_block(block, order);
+				order--;
+
+				if (pfn >= block_pfn + pages_per_block(order)) {
+					block += pages_per_block(order);
+					block_pfn += pages_per_block(order);
+				}
+			}
+
+			remove_block(block, order);
+			pfn = block_pfn + pages_per_block(order);
+		}
+
+		return reserved_all;
+	}
+
+
+	/**
+	 * Initialises the allocation algorithm.  The free areas are not built until the allocator is first
+	 * used, because the per-page free state is kept in pages taken from the managed range, and the
+	 * kernel has not reserved the pages it is using yet.
+	 * @param page_descriptors pgd to start allocating from
+	 * @param nr_page_descriptors number of pages in the system
+	 * @return Returns TRUE if the algorithm was successfully initialised, FALSE otherwise.
+	 */
+	bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) override
+	{
+		mm_log.messagef(LogLevel::DEBUG, "Buddy Allocator Initialising pd=%p, nr=0x%lx", page_descriptors, nr_page_descriptors);
+
+		// Free lists link to the previous block by its 32-bit index.
+		if (nr_page_descriptors > NO_PREV) {
+			mm_log.messagef(LogLevel::WARNING, "Buddy Allocator can only manage 0x%lx pages", (uint64_t)NO_PREV);
+			nr_page_descriptors = NO_PREV;
+		}
+
+		_page_descriptors = page_descriptors;
+		_nr_page_descriptors = nr_page_descriptors;
+		_benchmark_pending = pgalloc_benchmark_requested;
+		_lazy_coalescing = pgalloc_lazy_requested;
+		buddy_allocator = this;
+
+		// No page has been reserved yet.
+		for (uint64_t i = 0; i < nr_page_descriptors; i++) {
+			page_descriptors[i].next_free = NULL;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Makes a range of pages that was reserved available for allocation again, in a single pass over
+	 * the range.  The range is covered by the largest naturally aligned blocks that fit in it, so ranges
+	 * of any size and alignment can be inserted.
+	 * @param start The page descriptor of the first page in the range.
+	 * @param count The number of pages in the range.
+	 */
+	void insert_page_range(PageDescriptor *start, uint64_t count)
+	{
+		UniqueSpinLock l(_lock);
+
+		ensure_built();
+		insert_range(start, count);
+	}
+
+	/**
+	 * Returns the friendly name of the allocation algorithm, for debugging and selection purposes.
+	 */
+	const char* name() const override { return "buddy"; }
+	
+	/**
+	 * Allocates 2^order number of contiguous pages, with their memory zeroed.  Single pages come from
+	 * the pool of pages that have already been zeroed, if it is not empty.  Otherwise, the pages are
+	 * allocated as normal and zeroed before they are returned.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *alloc_zeroed_pages(int order)
+	{
+		if (order == 0) {
+			UniqueSpinLock l(_lock);
+
+			if (_zero_pool) {
+				PageDescriptor *pgd = _zero_pool;
+				_zero_pool = pgd->next_free;
+				_nr_zero_pages--;
+
+				pgd->next_free = NULL;
+				_stats.orders[0].allocs++;
+				return pgd;
+			}
+		}
+
+		PageDescriptor *block = alloc_pages(order);
+		if (block) {
+			zero_block(block, order);
+		}
+
+		return block;
+	}
+
+	/**
+	 * Tops up the pool of zeroed pages.  This is meant to be called when the CPU would otherwise be
+	 * idle, so that pages are zeroed ahead of time rather than on the allocation path.  The pages are
+	 * zeroed without the allocator lock held.
+	 * @param budget The maximum number of pages to zero.
+	 * @return Returns the number of pages that were zeroed and added to the pool.
+	 */
+	unsigned int refill_zero_pool(unsigned int budget)
+	{
+		unsigned int zeroed = 0;
+
+		while (zeroed < budget) {
+			PageDescriptor *pgd;
+
+			{
+				UniqueSpinLock l(_lock);
+
+				if (_nr_zero_pages >= ZERO_POOL_HIGH) {
+					break;
+				}
+
+				ensure_built();
+
+				pgd = alloc_hot_page();
+			}
+
+			if (!pgd) {
+				break;
+			}
+
+			zero_block(pgd, 0);
+
+			{
+				UniqueSpinLock l(_lock);
+
+				pgd->next_free = _zero_pool;
+				_zero_pool = pgd;
+				_nr_zero_pages++;
+			}
+
+			zeroed++;
+		}
+
+		return zeroed;
+	}
+
+	/**
+	 * Turns lazy coalescing on or off.  In lazy coalescing mode, freed blocks are not merged with their
+	 * buddies straight away.  Instead they wait on per-order unmerged lists, where they can be handed
+	 * straight back out to allocations of the same order, and are only merged when a larger block is
+	 * needed or more than UNMERGED_HIGH blocks are waiting.  It is on from the start if "pgalloc.lazy=1" is
+	 * on the kernel command line.
+	 * @param enabled TRUE to turn lazy coalescing on, FALSE to turn it off.
+	 */
+	void set_lazy_coalescing(bool enabled)
+	{
+		UniqueSpinLock l(_lock);
+
+		_lazy_coalescing = enabled;
+
+		if (!enabled) {
+			coalesce_unmerged();
+		}
+	}
+
+	/**
+	 * Returns the allocator statistics.  These are maintained as the allocator runs, so reading them
+	 * is cheap.
+	 */
+	const AllocatorStats& stats() const { return _stats; }
+
+	/**
+	 * Returns the migrate type of the pageblock that contains the given page, i.e. the free lists its
+	 * free blocks go on.
+	 * @param pgd The page descriptor of the page.
+	 */
+	MigrateType::MigrateType page_migrate_type(const PageDescriptor *pgd) const
+	{
+		UniqueSpinLock l(_lock);
+		return pageblock_type(pgd);
+	}
+
+	/**
+	 * Walks every free list, and checks that it agrees with the rest of the free state: each block
+	 * is aligned, in the zone and pageblock type of its list, and marked free in the list's order, the
+	 * back links and non-empty masks match the lists, and the free page and block counts add up.  This
+	 * touches every page, so it is only meant for debugging.
+	 * @return Returns TRUE if the free state is consistent, FALSE otherwise.
+	 */
+	bool check_free_areas() const
+	{
+		UniqueSpinLock l(_lock);
+
+		if (!_built) {
+			return true;
+		}
+
+		uint64_t zone_free_pages[NR_ZONES] = { 0 };
+		uint64_t free_blocks[MAX_ORDER] = { 0 };
+		uint64_t nr_free_blocks = 0;
+
+		for (unsigned int zone = 0; zone < NR_ZONES; zone++) {
+			for (unsigned int type = 0; type < MIGRATE_TYPES; type++) {
+				for (int order = 0; order < MAX_ORDER; order++) {
+					const PageDescriptor *head = _free_areas[zone][order][type];
+					if (!head != !(_nonempty_orders[zone][type] & (1u << order))) {
+						return false;
+					}
+
+					uint32_t prev = NO_PREV;
+					for (const PageDescriptor *pgd = head; pgd; pgd = pgd->next_free) {
+						uint64_t index = block_index(pgd);
+						if (index >= _nr_page_descriptors || _free_order[index] != order || _prev_free[index] != prev) {
+							return false;
+						}
+
+						if (!is_correct_alignment_for_order(pgd, order) || page_zone(pgd) != zone || pageblock_type(pgd) != type) {
+							return false;
+						}
+
+						zone_free_pages[zone] += pages_per_block(order);
+						free_blocks[order]++;
+						nr_free_blocks++;
+						prev = index;
+					}
+				}
+			}
+		}
+
+		for (unsigned int zone = 0; zone < NR_ZONES; zone++) {
+			if (zone_free_pages[zone] != _zone_free_pages[zone]) {
+				return false;
+			}
+		}
+
+		for (int order = 0; order < MAX_ORDER; order++) {
+			if (free_blocks[order] != _stats.orders[order].free_blocks) {
+				return false;
+			}
+		}
+
+		// No page outside the free lists may still be marked as the start of a free block.
+		uint64_t nr_marked = 0;
+		for (uint64_t index = 0; index < _nr_page_descriptors; index++) {
+			if (_free_order[index] != NOT_FREE) {
+				nr_marked++;
+			}
 		}
+
+		return nr_marked == nr_free_blocks;
 	}
 
+	/**
+	 * Runs timed loops of allocations and frees for each order, and logs the average cost in cycles as
+	 * one "bench buddy" line of key=value pairs per pattern and order.  The patterns are:
+	 *  - batch: allocate a batch of blocks, then free them all.
+	 *  - pair: allocate a block and free it straight away.
+	 *  - fragmented: free every other block of a batch, then allocate blocks of the next order up,
+	 *    which cannot be carved from the holes that were left.
+	 * The benchmark's allocations are left out of the statistics, and never make the allocator
+	 * release the pages it holds back, so running it does not disturb what the counters or the hot
+	 * page cache and zeroed page pool would otherwise show.  Each order holds fewer than BENCH_BATCH
+	 * blocks if that many would take more than 1/BENCH_FREE_SHARE of the free memory, so that running
+	 * it early on never leaves the rest of the kernel short.  It is run on the first allocation if
+	 * "pgalloc.bench=1" is on the kernel command line.
+	 * @param max_order The largest order to measure.
+	 * @param rounds The number of times to repeat each pattern.
+	 * @return Returns the number of allocations that failed.
+	 */
+	uint64_t run_benchmark(int max_order, unsigned int rounds)
+	{
+		PageDescriptor *blocks[BENCH_BATCH];
+		PageDescriptor *larger[BENCH_BATCH / 2];
+		OrderStats saved[MAX_ORDER];
+		uint64_t free_pages, total_failures = 0;
+
+		{
+			UniqueSpinLock l(_lock);
+			ensure_built();
+
+			for (int i = 0; i < MAX_ORDER; i++) {
+				saved[i] = _stats.orders[i];
+			}
+
+			// Normal allocations may use DMA32 memory down to its reserve.
+			free_pages = _zone_free_pages[Zone::NORMAL];
+			if (_zone_free_pages[Zone::DMA32] > lowmem_reserve()) {
+				free_pages += _zone_free_pages[Zone::DMA32] - lowmem_reserve();
+			}
+		}
+
+		for (int order = 0; order <= max_order && order < MAX_ORDER; order++) {
+			uint64_t alloc_cycles = 0, free_cycles = 0, ops = 0, failures = 0;
+
+			// The fragmented pattern holds half as much again as a batch while it allocates the larger
+			// blocks, so a batch is two thirds of the memory the benchmark may hold.
+			uint64_t batch = ((free_pages / BENCH_FREE_SHARE) >> order) * 2 / 3;
+			if (batch > BENCH_BATCH) {
+				batch = BENCH_BATCH;
+			}
+
+			if (!batch) {
+				break;
+			}
+
+			for (unsigned int round = 0; round < rounds; round++) {
+				uint64_t start = read_cycle_counter();
+				unsigned int count = 0;
+				for (unsigned int i = 0; i < batch; i++) {
+					if (!(blocks[count] = bench_alloc(order))) {
+						failures++;
+						break;
+					}
+
+					count++;
+				}
+
+				uint64_t middle = read_cycle_counter();
+				for (unsigned int i = 0; i < count; i++) {
+					bench_free(blocks[i], order);
+				}
+
+				free_cycles += read_cycle_counter() - middle;
+				alloc_cycles += middle - start;
+				ops += count;
+			}
+
+			log_benchmark("batch", order, ops, alloc_cycles, free_cycles, failures);
+			total_failures += failures;
+
+			alloc_cycles = free_cycles = ops = failures = 0;
+			for (unsigned int round = 0; round < rounds; round++) {
+				for (unsigned int i = 0; i < batch; i++) {
+					uint64_t start = read_cycle_counter();
+					PageDescriptor *pgd = bench_alloc(order);
+					uint64_t middle = read_cycle_counter();
+
+					if (!pgd) {
+						failures++;
+						continue;
+					}
+
+					bench_free(pgd, order);
+					free_cycles += read_cycle_counter() - middle;
+					alloc_cycles += middle - start;
+					ops++;
+				}
+			}
+
+			log_benchmark("pair", order, ops, alloc_cycles, free_cycles, failures);
+			total_failures += failures;
+
+			if (order + 1 >= MAX_ORDER) {
+				continue;
+			}
+
+			alloc_cycles = free_cycles = ops = failures = 0;
+			for (unsigned int round = 0; round < rounds; round++) {
+				unsigned int count = 0;
+				while (count < batch && (blocks[count] = bench_alloc(order))) {
+					count++;
+				}
+
+				for (unsigned int i = 1; i < count; i += 2) {
+					bench_free(blocks[i], order);
+				}
+
+				uint64_t start = read_cycle_counter();
+				unsigned int nr_larger = 0;
+				while (nr_larger < count / 2) {
+					if (!(larger[nr_larger] = bench_alloc(order + 1))) {
+						failures++;
+						break;
+					}
+
+					nr_larger++;
+				}
+
+				uint64_t middle = read_cycle_counter();
+				for (unsigned int i = 0; i < nr_larger; i++) {
+					bench_free(larger[i], order + 1);
+				}
+
+				free_cycles += read_cycle_counter() - middle;
+				alloc_cycles += middle - start;
+				ops += nr_larger;
+
+				for (unsigned int i = 0; i < count; i += 2) {
+					bench_free(blocks[i], order);
+				}
+			}
+
+			log_benchmark("fragmented", order + 1, ops, alloc_cycles, free_cycles, failures);
+			total_failures += failures;
+		}
+
+		// Take the benchmark's own splits and merges back out of the statistics.
+		UniqueSpinLock l(_lock);
+		for (int i = 0; i < MAX_ORDER; i++) {
+			_stats.orders[i].splits = saved[i].splits;
+			_stats.orders[i].merges = saved[i].merges;
+		}
+
+		return total_failures;
+	}
 	
+	/**
+	 * Dumps out the current state of the buddy system.  The state is copied out under the lock, and
+	 * logged once it has been released, so that interrupts are not held off while the log is written.
+	 */
+	void dump_state() const override
+	{
+		AllocatorStats stats;
+		uint64_t zone_free_pages[NR_ZONES], zone_managed_pages[NR_ZONES], reserve;
+		unsigned int nr_hot_pages, nr_unmerged, nr_zero_pages;
+
+		{
+			UniqueSpinLock l(_lock);
+
+			stats = _stats;
+			for (unsigned int i = 0; i < NR_ZONES; i++) {
+				zone_free_pages[i] = _zone_free_pages[i];
+				zone_managed_pages[i] = _zone_managed_pages[i];
+			}
+
+			reserve = lowmem_reserve();
+			nr_hot_pages = _hot_pages.count;
+			nr_unmerged = _nr_unmerged;
+			nr_zero_pages = _nr_zero_pages;
+		}
+
+		// Print out a header, so we can find the output in the logs.
+		mm_log.messagef(LogLevel::DEBUG, "BUDDY STATE:");
+		
+		// Print out the counters for each order.
+		for (unsigned int i = 0; i < ARRAY_SIZE(stats.orders); i++) {
+			const OrderStats& order = stats.orders[i];
+
+			mm_log.messagef(LogLevel::DEBUG, "[%d] free=%lu allocs=%lu frees=%lu splits=%lu merges=%lu failures=%lu",
+				i, order.free_blocks, order.allocs, order.frees, order.splits, order.merges, order.failures);
+		}
+
+		mm_log.messagef(LogLevel::DEBUG, "ZONE DMA32: free=%lu managed=%lu reserve=%lu",
+			zone_free_pages[Zone::DMA32], zone_managed_pages[Zone::DMA32], reserve);
+		mm_log.messagef(LogLevel::DEBUG, "ZONE NORMAL: free=%lu managed=%lu",
+			zone_free_pages[Zone::NORMAL], zone_managed_pages[Zone::NORMAL]);
+		mm_log.messagef(LogLevel::DEBUG, "HOT PAGES: %u", nr_hot_pages);
+		mm_log.messagef(LogLevel::DEBUG, "UNMERGED BLOCKS: %u", nr_unmerged);
+		mm_log.messagef(LogLevel::DEBUG, "ZEROED PAGES: %u", nr_zero_pages);
+
+		// Print out the non-empty buckets of the latency histograms.
+		for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+			if (stats.alloc_latency[i] || stats.free_latency[i]) {
+				mm_log.messagef(LogLevel::DEBUG, "LATENCY <%lu cycles: alloc=%lu free=%lu",
+					(uint64_t)2 << i, stats.alloc_latency[i], stats.free_latency[i]);
+			}
+		}
+	}
+
+	// The allocator that the functions in buddy.h act on, which is the one initialised last.
+	static BuddyPageAllocator *buddy_allocator;
+
 private:
-	PageDescriptor *_free_areas[MAX_ORDER];
+	/**
+	 * A cache of free single pages, kept in front of the free areas so that most order-0 allocations
+	 * and frees never have to split or merge.  Pages in the cache are linked through next_free, and
+	 * as far as the free areas are concerned they are allocated.
+	 */
+	struct HotPageCache {
+		PageDescriptor *head;
+		unsigned int count;
+	};
+
+	// Marks a page that is not the first page of a free block in _free_order.
+	static const int8_t NOT_FREE = -1;
+	// Marks the first block in a free list in _prev_free.
+	static const uint32_t NO_PREV = 0xffffffff;
+
+	PageDescriptor *_free_areas[NR_ZONES][MAX_ORDER][MIGRATE_TYPES];
+
+	// For each zone and migrate type, bit N is set when _free_areas[zone][N][type] is not empty.
+	uint32_t _nonempty_orders[NR_ZONES][MIGRATE_TYPES];
+
+	// The number of free pages in each zone, and the number of pages that were ever made available.
+	uint64_t _zone_free_pages[NR_ZONES];
+	uint64_t _zone_managed_pages[NR_ZONES];
+
+	// InfOS only brings up the boot CPU, so there is a single hot page cache.
+	HotPageCache _hot_pages;
+
+	// Blocks that have been freed in lazy coalescing mode, but not yet merged with their buddies.  As
+	// far as the free areas are concerned they are allocated.
+	PageDescriptor *_unmerged[MAX_ORDER][MIGRATE_TYPES];
+	unsigned int _nr_unmerged;
+	bool _lazy_coalescing;
+
+	// Single pages that have already been zeroed, linked through next_free.  As far as the free areas
+	// are concerned they are allocated.
+	PageDescriptor *_zero_pool;
+	unsigned int _nr_zero_pages;
+
+	AllocatorStats _stats;
+
+	// Protects everything else in the allocator.
+	mutable SpinLock _lock;
+
+	// The range of page descriptors being managed, and whether the free areas have been built yet.
+	PageDescriptor *_page_descriptors;
+	uint64_t _nr_page_descriptors;
+	bool _built;
+
+	// Set from the command line at init(), until the benchmark has been run.
+	bool _benchmark_pending;
+
+	// Per-page free state, indexed by the page's position in the managed range.  For the first
+	// page of a free block, these hold the index of the previous block in the free list and the
+	// order the block is free in.  They live in pages taken from the managed range.
+	uint32_t *_prev_free;
+	int8_t *_free_order;
+
+	// The migrate type of each pageblock in the managed range.
+	uint8_t *_pageblock_type;
 };
 
+BuddyPageAllocator *BuddyPageAllocator::buddy_allocator;
+
+PageDescriptor *buddy_alloc_pages(int order, MigrateType::MigrateType type, Zone::Zone zone)
+{
+	BuddyPageAllocator *allocator = BuddyPageAllocator::buddy_allocator;
+	return allocator ? allocator->alloc_pages(order, type, zone) : NULL;
+}
+
+void buddy_free_pages(PageDescriptor *pgd, int order)
+{
+	BuddyPageAllocator::buddy_allocator->free_pages(pgd, order);
+}
+
+unsigned int buddy_alloc_pages_bulk(int order, unsigned int count, PageDescriptor **out,
+	MigrateType::MigrateType type, Zone::Zone zone)
+{
+	BuddyPageAllocator *allocator = BuddyPageAllocator::buddy_allocator;
+	return allocator ? allocator->alloc_pages_bulk(order, count, out, type, zone) : 0;
+}
+
+void buddy_free_pages_bulk(PageDescriptor **pgds, unsigned int count, int order)
+{
+	BuddyPageAllocator::buddy_allocator->free_pages_bulk(pgds, count, order);
+}
+
+PageDescriptor *buddy_alloc_zeroed_pages(int order)
+{
+	BuddyPageAllocator *allocator = BuddyPageAllocator::buddy_allocator;
+	return allocator ? allocator->alloc_zeroed_pages(order) : NULL;
+}
+
+unsigned int buddy_refill_zero_pool(unsigned int budget)
+{
+	BuddyPageAllocator *allocator = BuddyPageAllocator::buddy_allocator;
+	return allocator ? allocator->refill_zero_pool(budget) : 0;
+}
+
+bool buddy_set_lazy_coalescing(bool enabled)
+{
+	BuddyPageAllocator *allocator = BuddyPageAllocator::buddy_allocator;
+	if (!allocator) {
+		return false;
+	}
+
+	allocator->set_lazy_coalescing(enabled);
+	return true;
+}
+
 /* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
 
 /*
@@ -0,0 +1,94 @@
+/*
+ * Buddy Page Allocator
+ *
+ * Lets the kernel use the parts of the buddy page allocator that are not in the PageAllocatorAlgorithm
+ * interface: allocations of a given migrate type and zone, bulk allocations, pre-zeroed pages and lazy
+ * coalescing.  These act on the buddy allocator if it is the algorithm in use, and fail otherwise.
+ */
+#pragma once
+
+#include <infos/mm/page-allocator.h>
+
+#define MIGRATE_TYPES	3
+
+namespace MigrateType {
+	enum MigrateType {
+		UNMOVABLE = 0,
+		RECLAIMABLE = 1,
+		MOVABLE = 2,
+	};
+}
+
+// Memory below 4GB is in the DMA32 zone, and everything above it is in the normal zone.
+#define NR_ZONES	2
+#define DMA32_LIMIT_PFN	(1 << 20)
+
+namespace Zone {
+	enum Zone {
+		DMA32 = 0,
+		NORMAL = 1,
+	};
+}
+
+/**
+ * Allocates 2^order contiguous pages of the given migrate type.  Pages that can be moved or
+ * reclaimed should be asked for as such, so that they are kept apart from unmovable pages.
+ * @param order The power of two, of the number of contiguous pages to allocate.
+ * @param type The migrate type of the allocation.
+ * @param zone The preferred zone of the allocation.
+ * @return Returns the first page descriptor of the block, or NULL if allocation failed or the buddy
+ * allocator is not in use.
+ */
+infos::mm::PageDescriptor *buddy_alloc_pages(int order, MigrateType::MigrateType type, Zone::Zone zone = Zone::NORMAL);
+
+/**
+ * Frees 2^order contiguous pages allocated by any of these functions.
+ * @param pgd The first page descriptor of the block.
+ * @param order The power of two number of contiguous pages to free.
+ */
+void buddy_free_pages(infos::mm::PageDescriptor *pgd, int order);
+
+/**
+ * Allocates up to "count" blocks of 2^order contiguous pages, for much less than "count" separate
+ * allocations would cost.
+ * @param order The power of two, of the number of contiguous pages in each block.
+ * @param count The number of blocks to allocate.
+ * @param out An array of at least "count" entries, which is filled with the allocated blocks.
+ * @param type The migrate type of the allocation.
+ * @param zone The preferred zone of the allocation.
+ * @return Returns the number of blocks allocated.
+ */
+unsigned int buddy_alloc_pages_bulk(int order, unsigned int count, infos::mm::PageDescriptor **out,
+	MigrateType::MigrateType type = MigrateType::UNMOVABLE, Zone::Zone zone = Zone::NORMAL);
+
+/**
+ * Frees "count" blocks of 2^order contiguous pages in one go.
+ * @param pgds An array of the first page descriptors of the blocks to free.
+ * @param count The number of blocks to free.
+ * @param order The power of two number of contiguous pages in each block.
+ */
+void buddy_free_pages_bulk(infos::mm::PageDescriptor **pgds, unsigned int count, int order);
+
+/**
+ * Allocates 2^order contiguous pages with their memory zeroed, taking single pages from the pool of
+ * pages that were zeroed ahead of time where it can.
+ * @param order The power of two, of the number of contiguous pages to allocate.
+ * @return Returns the first page descriptor of the block, or NULL if allocation failed or the buddy
+ * allocator is not in use.
+ */
+infos::mm::PageDescriptor *buddy_alloc_zeroed_pages(int order);
+
+/**
+ * Zeroes free pages ahead of time for buddy_alloc_zeroed_pages().  Meant for the idle loop, or any
+ * other time the CPU has nothing better to do.
+ * @param budget The maximum number of pages to zero.
+ * @return Returns the number of pages that were zeroed.
+ */
+unsigned int buddy_refill_zero_pool(unsigned int budget);
+
+/**
+ * Turns lazy coalescing on or off.  "pgalloc.lazy=1" on the kernel command line turns it on from boot.
+ * @param enabled TRUE to turn lazy coalescing on, FALSE to turn it off.
+ * @return Returns TRUE if the buddy allocator is in use, FALSE otherwise.
+ */
+bool buddy_set_lazy_coalescing(bool enabled);
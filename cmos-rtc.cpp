@@ -9,10 +9,42 @@
 
 #define CURRENT_YEAR        2020  
 
-#include <infos/drivers/timer/rtc.h>
+#define RTC_STATUS_A		0x0A
+#define RTC_STATUS_B		0x0B
+#define RTC_STATUS_C		0x0C
+#define RTC_RATE_MASK		0x0F	// RS: the periodic interrupt rate in status register A
+#define RTC_SET			0x80	// SET: halts updates while the time is set, in status register B
+#define RTC_PERIODIC_ENABLE	0x40	// PIE: enables the periodic interrupt in status register B
+#define RTC_PERIODIC		0x40	// PF: set in status register C on each periodic interrupt
+#define RTC_UPDATE_ENDED	0x10	// UF: set in status register C when an update cycle finishes
+
+#define NS_PER_SECOND		1000000000ULL
+
+// The TSC rate is measured again once two update edges this many seconds apart have been caught.
+#define DRIFT_INTERVAL		64
+
+// How far the predicted time of an update edge may be from the real one, which covers a drift of
+// 300ppm over DRIFT_INTERVAL.  Polling for an edge starts this long before it is predicted.
+#define DRIFT_MARGIN_NS		20000000ULL
+
+// An update ends every second, so a wait for one gives up after this many cycles, which is over
+// two seconds for any TSC up to 8GHz.
+#define UPDATE_WAIT_CYCLES	(1ULL << 34)
+
+// The level of an alarm that has expired, but whose callback has not been run yet.
+#define WHEEL_EXPIRED		0xff
+
+// The number of reads that the benchmark times for each kind of read.
+#define BENCH_ITERATIONS	10000
+
+#include "cmos-rtc.h"
+
 #include <infos/util/lock.h>
 #include <arch/x86/pio.h>
 #include <infos/kernel/log.h>
+#include <infos/kernel/cmdline.h>
+
+#include "cycle-counter.h"
 
 using namespace infos::arch::x86;
 using namespace infos::kernel;
@@ -20,22 +52,629 @@ using namespace infos::drivers;
 using namespace infos::drivers::timer;
 using namespace infos::util;
 
-class CMOSRTC : public RTC {
-public:
-	static const DeviceClass CMOSRTCDeviceClass;
+// Set by "rtc.bench=1" on the kernel command line.
+static bool rtc_benchmark_requested;
+
+RegisterCmdLineArgument(RTCBenchmark, "rtc.bench")
+{
+	rtc_benchmark_requested = value[0] && value[0] != '0';
+}
+
+/**
+ * Returns the number of seconds between 1970-01-01 and the given date & time.
+ * @param tp The date & time, with a two-digit year in the current century.
+ */
+static uint64_t timepoint_to_seconds(const RTCTimePoint& tp)
+{
+	//days from the civil calendar, counting years from March so that leap days come last
+	int64_t year = (CURRENT_YEAR / 100) * 100 + tp.year - (tp.month <= 2 ? 1 : 0);
+	int64_t era = year / 400;
+	int64_t year_of_era = year - era * 400;
+	int64_t day_of_year = (153 * (tp.month + (tp.month > 2 ? -3 : 9)) + 2) / 5 + tp.day_of_month - 1;
+	int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+	int64_t days = era * 146097 + day_of_era - 719468;
+
+	return (uint64_t)days * 86400 + tp.hours * 3600 + tp.minutes * 60 + tp.seconds;
+}
+
+/**
+ * Scales a TSC reading to nanoseconds.
+ * @param cycles The TSC reading.
+ * @param mult Nanoseconds per cycle, in 32.32 fixed point.
+ * @param base_cycles A TSC reading at which the time is known.
+ * @param base_ns The time at base_cycles.
+ */
+static inline uint64_t cycles_to_ns(uint64_t cycles, uint64_t mult, uint64_t base_cycles, uint64_t base_ns)
+{
+	return base_ns + (uint64_t)(((unsigned __int128)(cycles - base_cycles) * mult) >> 32);
+}
+
+/**
+ * Adds one timed read to the benchmark totals.
+ */
+static inline void record_benchmark(uint64_t cycles, uint64_t& total, uint64_t& worst)
+{
+	total += cycles;
+	if (cycles > worst) {
+		worst = cycles;
+	}
+}
+
+/**
+ * Logs one line of benchmark results.
+ */
+static void log_benchmark(const char *op, unsigned int iterations, uint64_t total, uint64_t worst)
+{
+	syslog.messagef(LogLevel::INFO, "bench rtc op=%s iterations=%u avg_cycles=%lu max_cycles=%lu",
+		op, iterations, iterations ? total / iterations : 0, worst);
+}
+
+TimerWheel::TimerWheel() : _next(1), _nr_pending(0), _expired_head(NULL), _expired_tail(NULL)
+{
+	for (unsigned int level = 0; level < WHEEL_LEVELS; level++) {
+		for (unsigned int slot = 0; slot < WHEEL_SLOTS; slot++) {
+			_slots[level][slot] = NULL;
+		}
+
+		_occupied[level] = 0;
+	}
+}
+
+void TimerWheel::add_alarm(TimerAlarm& alarm, uint64_t ticks)
+{
+	UniqueIRQLock l;
+
+	if (alarm.pending) {
+		unlink_alarm(&alarm);
+	}
+
+	alarm.expires = _next - 1 + (ticks ? ticks : 1);
+	link_alarm(&alarm);
+}
+
+bool TimerWheel::cancel_alarm(TimerAlarm& alarm)
+{
+	UniqueIRQLock l;
+
+	if (!alarm.pending) {
+		return false;
+	}
+
+	unlink_alarm(&alarm);
+	return true;
+}
+
+void TimerWheel::advance(uint64_t ticks)
+{
+	{
+		UniqueIRQLock l;
+
+		uint64_t end = _next + ticks;
+		while (_next < end) {
+			//nothing is pending, so there is nothing to cascade or expire on the way
+			if (!_nr_pending) {
+				_next = end;
+				break;
+			}
+
+			//each time a level wraps round, the next slot of the level above is cascaded
+			unsigned int slot = _next & WHEEL_MASK;
+			for (unsigned int level = 1; level < WHEEL_LEVELS; level++) {
+				unsigned int index = (_next >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK;
+				if (index) {
+					break;
+				}
+
+				cascade(level, (_next >> (WHEEL_BITS * level)) & WHEEL_MASK);
+			}
+
+			while (_slots[0][slot]) {
+				TimerAlarm *alarm = _slots[0][slot];
+				unlink_alarm(alarm);
+				expire_alarm(alarm);
+			}
+
+			_next++;
+		}
+	}
+
+	//each alarm is taken off the expired list with the lock held just before its callback
+	//is run, so the list is never walked while a callback can change it
+	for (;;) {
+		TimerAlarm *alarm;
+
+		{
+			UniqueIRQLock l;
+
+			alarm = _expired_head;
+			if (!alarm) {
+				break;
+			}
+
+			unlink_alarm(alarm);
+		}
+
+		alarm->callback(alarm);
+	}
+}
+
+/**
+ * Puts an alarm in the slot for its expiry tick, on the lowest level that reaches that
+ * far ahead of the next tick to be processed.
+ * @param alarm The alarm to link.
+ */
+void TimerWheel::link_alarm(TimerAlarm *alarm)
+{
+	uint64_t expires = alarm->expires;
+	uint64_t delta = expires - _next;
+
+	unsigned int level = 0;
+	while (level < WHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << (WHEEL_BITS * (level + 1)))) {
+		level++;
+	}
+
+	//beyond the range of the wheel, so keep it in the furthest top-level slot, and it will
+	//be placed again when that slot is cascaded
+	if (delta >= ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))) {
+		expires = _next + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	}
+
+	unsigned int slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+	alarm->level = level;
+	alarm->slot = slot;
+	alarm->prev = NULL;
+	alarm->next = _slots[level][slot];
+	if (alarm->next) {
+		alarm->next->prev = alarm;
+	}
+
+	_slots[level][slot] = alarm;
+	_occupied[level] |= (uint64_t)1 << slot;
+	alarm->pending = true;
+	_nr_pending++;
+}
+
+/**
+ * Puts an alarm that has just been taken off the wheel on the tail of the expired list.
+ * It stays pending until it is taken off the list to have its callback run.
+ * @param alarm The alarm that has expired.
+ */
+void TimerWheel::expire_alarm(TimerAlarm *alarm)
+{
+	alarm->level = WHEEL_EXPIRED;
+	alarm->next = NULL;
+	alarm->prev = _expired_tail;
+
+	if (_expired_tail) {
+		_expired_tail->next = alarm;
+	} else {
+		_expired_head = alarm;
+	}
+
+	_expired_tail = alarm;
+	alarm->pending = true;
+}
+
+/**
+ * Takes an alarm off the wheel, or off the expired list.
+ * @param alarm The alarm to unlink.
+ */
+void TimerWheel::unlink_alarm(TimerAlarm *alarm)
+{
+	if (alarm->level == WHEEL_EXPIRED) {
+		if (alarm->prev) {
+			alarm->prev->next = alarm->next;
+		} else {
+			_expired_head = alarm->next;
+		}
+
+		if (alarm->next) {
+			alarm->next->prev = alarm->prev;
+		} else {
+			_expired_tail = alarm->prev;
+		}
+
+		alarm->next = NULL;
+		alarm->prev = NULL;
+		alarm->pending = false;
+		return;
+	}
+
+	if (alarm->prev) {
+		alarm->prev->next = alarm->next;
+	} else {
+		_slots[alarm->level][alarm->slot] = alarm->next;
+		if (!alarm->next) {
+			_occupied[alarm->level] &= ~((uint64_t)1 << alarm->slot);
+		}
+	}
+
+	if (alarm->next) {
+		alarm->next->prev = alarm->prev;
+	}
+
+	alarm->next = NULL;
+	alarm->prev = NULL;
+	alarm->pending = false;
+	_nr_pending--;
+}
+
+/**
+ * Places every alarm in a slot again, which moves them to lower levels.
+ * @param level The level of the slot.
+ * @param slot The slot to cascade.
+ */
+void TimerWheel::cascade(unsigned int level, unsigned int slot)
+{
+	TimerAlarm *alarm = _slots[level][slot];
+	_slots[level][slot] = NULL;
+	_occupied[level] &= ~((uint64_t)1 << slot);
+
+	while (alarm) {
+		TimerAlarm *next = alarm->next;
+		_nr_pending--;
+		link_alarm(alarm);
+		alarm = next;
+	}
+}
+
+CMOSRTC::CMOSRTC() : _cache_valid(false), _status_flags(0), _calibrated(false), _last_poll_cycles(0),
+	_drift_alarm(drift_alarm_expired, this)
+{
+	_clock.sequence = 0;
+}
+
+bool CMOSRTC::init(DeviceManager& dm)
+{
+	calibrate_tsc();
+
+	//the first check only measures the length of a tick
+	if (_calibrated) {
+		_drift_check_ticks = 0;
+		_timers.add_alarm(_drift_alarm, 1);
+	}
+
+	if (rtc_benchmark_requested) {
+		run_benchmark(BENCH_ITERATIONS);
+	}
+
+	return true;
+}
+
+void CMOSRTC::read_timepoint(RTCTimePoint& tp)
+{
+	UniqueIRQLock l;
+
+	//reading status register C clears the update-ended flag, so it has to be done
+	//before the time registers are read, in case an update finishes while reading
+	uint64_t now = read_cycle_counter();
+	bool updated = read_status_flags(RTC_UPDATE_ENDED) & RTC_UPDATE_ENDED;
+	uint64_t last_poll = _last_poll_cycles;
+	_last_poll_cycles = now;
+
+	if (!updated && _cache_valid) {
+		tp = _cached_timepoint;
+		return;
+	}
+
+	read_hardware_timepoint(_cached_timepoint);
+	_cache_valid = true;
 
-	const DeviceClass& device_class() const override
+	//if the flag was clear a moment ago, the update ended between the two polls, which is
+	//close enough to use for correcting the TSC rate
+	if (updated && _calibrated && now - last_poll <= _edge_window_cycles) {
+		correct_drift(last_poll + (now - last_poll) / 2, _cached_timepoint);
+	}
+
+	tp = _cached_timepoint;
+}
+
+void CMOSRTC::set_periodic_rate(uint8_t rate)
+{
+	UniqueIRQLock l;
+
+	write_RTC_value(RTC_STATUS_A, (read_RTC_value(RTC_STATUS_A) & ~RTC_RATE_MASK) | (rate & RTC_RATE_MASK));
+	write_RTC_value(RTC_STATUS_B, read_RTC_value(RTC_STATUS_B) | RTC_PERIODIC_ENABLE);
+}
+
+void CMOSRTC::handle_interrupt()
+{
+	uint8_t flags;
 	{
-		return CMOSRTCDeviceClass;
+		UniqueIRQLock l;
+		flags = read_status_flags(RTC_PERIODIC);
+	}
+
+	if (flags & RTC_PERIODIC) {
+		_timers.advance(1);
+	}
+}
+
+void CMOSRTC::run_benchmark(unsigned int iterations)
+{
+	RTCTimePoint tp;
+	uint64_t total = 0, worst = 0;
+
+	for (unsigned int i = 0; i < iterations; i++) {
+		uint64_t start = read_cycle_counter();
+		read_timepoint(tp);
+		record_benchmark(read_cycle_counter() - start, total, worst);
+	}
+
+	log_benchmark("read_timepoint", iterations, total, worst);
+
+	total = worst = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		UniqueIRQLock l;
+
+		uint64_t start = read_cycle_counter();
+		read_hardware_timepoint(tp);
+		record_benchmark(read_cycle_counter() - start, total, worst);
+	}
+
+	log_benchmark("read_hardware", iterations, total, worst);
+
+	if (!_calibrated) {
+		return;
+	}
+
+	total = worst = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		uint64_t start = read_cycle_counter();
+		now_ns();
+		record_benchmark(read_cycle_counter() - start, total, worst);
+	}
+
+	log_benchmark("now_ns", iterations, total, worst);
+}
+
+uint64_t CMOSRTC::now_ns()
+{
+	if (!_calibrated) {
+		return 0;
+	}
+
+	uint64_t ns, wall_offset;
+	read_clock(ns, wall_offset);
+	return ns;
+}
+
+uint64_t CMOSRTC::wall_clock_ns()
+{
+	if (!_calibrated) {
+		return 0;
+	}
+
+	uint64_t ns, wall_offset;
+	read_clock(ns, wall_offset);
+	return ns + wall_offset;
+}
+
+/**
+ * Measures the TSC rate against two consecutive RTC update edges, which are one second
+ * apart.  This busy-waits for up to two seconds, so it is only done once, from init().  The
+ * TSC is assumed to tick at a nearly constant rate, and check_drift() measures it again as it
+ * drifts.  If the RTC is not updating, the clocks are left uncalibrated.
+ */
+void CMOSRTC::calibrate_tsc()
+{
+	//throw away a flag left over from an update that ended long ago
+	{
+		UniqueIRQLock l;
+		read_status_flags(RTC_UPDATE_ENDED);
+	}
+
+	RTCTimePoint tp;
+	uint64_t first_edge, second_edge, window;
+	if (!wait_for_update(tp, UPDATE_WAIT_CYCLES, first_edge, window) ||
+		!wait_for_update(tp, UPDATE_WAIT_CYCLES, second_edge, window)) {
+		syslog.messagef(LogLevel::WARNING, "cmos-rtc: rtc is not updating, so the tsc clocks are unavailable");
+		return;
+	}
+
+	uint64_t cycles_per_second = second_edge - first_edge;
+
+	UniqueIRQLock l;
+
+	uint64_t now = read_cycle_counter();
+	uint64_t mult = (uint64_t)(((unsigned __int128)NS_PER_SECOND << 32) / cycles_per_second);
+	write_clock(second_edge, 0, mult, timepoint_to_seconds(tp) * NS_PER_SECOND);
+
+	_anchor_cycles = second_edge;
+	_anchor_seconds = timepoint_to_seconds(tp);
+	_edge_window_cycles = cycles_per_second / 1000;
+	_last_poll_cycles = now;
+	_calibrated = true;
+
+	syslog.messagef(LogLevel::INFO, "cmos-rtc: tsc runs at %lu Hz", cycles_per_second);
+}
+
+/**
+ * Reads the current monotonic time and wall-clock offset from the clock record.
+ * @param ns Set to the monotonic time, in nanoseconds.
+ * @param wall_offset Set to the difference between wall-clock and monotonic time.
+ */
+void CMOSRTC::read_clock(uint64_t& ns, uint64_t& wall_offset) const
+{
+	uint32_t sequence;
+	do {
+		sequence = _clock.sequence;
+		asm volatile("" ::: "memory");
+
+		ns = cycles_to_ns(read_cycle_counter(), _clock.mult, _clock.base_cycles, _clock.base_ns);
+		wall_offset = _clock.wall_offset_ns;
+
+		asm volatile("" ::: "memory");
+	} while ((sequence & 1) || sequence != _clock.sequence);
+}
+
+/**
+ * Updates the clock record.  Must be called with interrupts disabled.
+ */
+void CMOSRTC::write_clock(uint64_t base_cycles, uint64_t base_ns, uint64_t mult, uint64_t wall_offset_ns)
+{
+	_clock.sequence++;
+	asm volatile("" ::: "memory");
+
+	_clock.base_cycles = base_cycles;
+	_clock.base_ns = base_ns;
+	_clock.mult = mult;
+	_clock.wall_offset_ns = wall_offset_ns;
+
+	asm volatile("" ::: "memory");
+	_clock.sequence++;
+}
+
+/**
+ * Busy-waits for the next RTC update to end, taking the IRQ lock for each poll only.
+ * @param tp Populated with the date & time the update set.
+ * @param budget_cycles How many cycles to wait for.
+ * @param edge_cycles Set to the TSC reading at the end of the update, halfway between the
+ * polls either side of it.
+ * @param window_cycles Set to the number of cycles between those polls.
+ * @return Returns true if an update ended, or false if none did within the budget, or if
+ * updates are halted by SET in status register B.
+ */
+bool CMOSRTC::wait_for_update(RTCTimePoint& tp, uint64_t budget_cycles, uint64_t& edge_cycles, uint64_t& window_cycles)
+{
+	if (read_RTC_value(RTC_STATUS_B) & RTC_SET) {
+		return false;
+	}
+
+	uint64_t start = read_cycle_counter();
+	uint64_t before = start;
+	for (;;) {
+		UniqueIRQLock l;
+
+		uint64_t now = read_cycle_counter();
+		_last_poll_cycles = now;
+
+		if (read_status_flags(RTC_UPDATE_ENDED)) {
+			read_hardware_timepoint(tp);
+			_cached_timepoint = tp;
+			_cache_valid = true;
+
+			edge_cycles = before + (now - before) / 2;
+			window_cycles = now - before;
+			return true;
+		}
+
+		if (now - start > budget_cycles) {
+			return false;
+		}
+
+		before = now;
 	}
+}
+
+void CMOSRTC::drift_alarm_expired(TimerAlarm *alarm)
+{
+	((CMOSRTC *)alarm->data)->check_drift();
+}
+
+/**
+ * Runs on ticks of the timer wheel, and catches the first update edge DRIFT_INTERVAL seconds
+ * after the last one the TSC rate was measured from, to measure it again.  The edge is predicted
+ * from the wall clock, and the alarm is armed for the last tick that comes at least
+ * DRIFT_MARGIN_NS before it, from which the edge is polled for.  So the busy-wait is bounded by a
+ * tick and twice the margin, once every DRIFT_INTERVAL seconds, and by just over a second
+ * however long the tick is.  An edge that is missed is tried for again a second later.
+ */
+void CMOSRTC::check_drift()
+{
+	uint64_t ns, wall_offset;
+	read_clock(ns, wall_offset);
+
+	//the wheel can be driven by any tick source, so the length of a tick is measured
+	uint64_t tick_ns = _drift_check_ticks ? (ns - _drift_check_ns) / _drift_check_ticks : 0;
+	_drift_check_ns = ns;
+
+	uint64_t wall_ns = ns + wall_offset;
+	uint64_t edge_seconds = wall_ns / NS_PER_SECOND + 1;
+	uint64_t until_edge = edge_seconds * NS_PER_SECOND - wall_ns;
+
+	uint64_t due_seconds = _anchor_seconds + DRIFT_INTERVAL;
+	if (edge_seconds < due_seconds) {
+		until_edge += (due_seconds - edge_seconds) * NS_PER_SECOND;
+	}
+
+	if (!tick_ns) {
+		_drift_check_ticks = 1;
+	} else if (until_edge > tick_ns + DRIFT_MARGIN_NS) {
+		_drift_check_ticks = (until_edge - DRIFT_MARGIN_NS) / tick_ns;
+	} else {
+		uint64_t budget_cycles = (uint64_t)(((unsigned __int128)(until_edge + DRIFT_MARGIN_NS) << 32) / _clock.mult);
+
+		//throw away the flag from the last edge, which nothing may have read
+		{
+			UniqueIRQLock l;
+			read_status_flags(RTC_UPDATE_ENDED);
+		}
+
+		RTCTimePoint tp;
+		uint64_t edge_cycles, window_cycles, cycles_per_second = 0;
+		if (wait_for_update(tp, budget_cycles, edge_cycles, window_cycles) && window_cycles <= _edge_window_cycles) {
+			UniqueIRQLock l;
+			cycles_per_second = correct_drift(edge_cycles, tp);
+		}
 
-	/**
-	 * Interrogates the RTC to read the current date & time.
-	 * @param tp Populates the tp structure with the current data & time, as
-	 * given by the CMOS RTC device.
-	 */
-	void read_timepoint(RTCTimePoint& tp) override
-	{   
+		if (cycles_per_second) {
+			syslog.messagef(LogLevel::DEBUG, "cmos-rtc: tsc rate measured again at %lu Hz", cycles_per_second);
+		}
+
+		_drift_check_ticks = 1;
+	}
+
+	_timers.add_alarm(_drift_alarm, _drift_check_ticks);
+}
+
+/**
+ * Measures the TSC rate again from an update edge and the last one used, once they are far
+ * enough apart.  The new rate takes effect from the current time, so the clock never jumps.
+ * Must be called with interrupts disabled.
+ * @param edge_cycles The TSC reading at the end of the update.
+ * @param tp The date & time the update set.
+ * @return Returns the new TSC rate in Hz, or zero if the rate was not measured again.
+ */
+uint64_t CMOSRTC::correct_drift(uint64_t edge_cycles, const RTCTimePoint& tp)
+{
+	uint64_t seconds = timepoint_to_seconds(tp);
+
+	//the RTC has been set backwards, so start measuring again from here
+	if (seconds <= _anchor_seconds) {
+		_anchor_cycles = edge_cycles;
+		_anchor_seconds = seconds;
+		return 0;
+	}
+
+	if (seconds - _anchor_seconds < DRIFT_INTERVAL) {
+		return 0;
+	}
+
+	uint64_t cycles_per_second = (edge_cycles - _anchor_cycles) / (seconds - _anchor_seconds);
+
+	uint64_t mult = (uint64_t)((((unsigned __int128)(seconds - _anchor_seconds) * NS_PER_SECOND) << 32) /
+		(edge_cycles - _anchor_cycles));
+
+	//the time registers take a while to read, so rebase at a fresh reading rather than at the poll
+	uint64_t now = read_cycle_counter();
+	uint64_t now_ns = cycles_to_ns(now, _clock.mult, _clock.base_cycles, _clock.base_ns);
+	uint64_t edge_ns = cycles_to_ns(edge_cycles, _clock.mult, _clock.base_cycles, _clock.base_ns);
+	write_clock(now, now_ns, mult, seconds * NS_PER_SECOND - edge_ns);
+
+	_anchor_cycles = edge_cycles;
+	_anchor_seconds = seconds;
+	return cycles_per_second;
+}
+
+/**
+ * Interrogates the RTC to read the current date & time.
+ * @param tp Populates the tp structure with the current data & time, as
+ * given by the CMOS RTC device.
+ */
+void CMOSRTC::read_hardware_timepoint(RTCTimePoint& tp)
+{   
         
 
       	unsigned char last_second;
@@ -47,7 +686,7 @@ public:
       	unsigned char registerB;
 
 
-		while(update_in_progress()); //hangs on this line until an update is no longer in progress
+	while(update_in_progress()); //hangs on this line until an update is no longer in progress
 
         //read all the values from the cmos clock
         unsigned char second = read_RTC_value(0x00);
@@ -110,25 +749,44 @@ public:
         tp.day_of_month = (unsigned short) day_of_month;
         tp.month = (unsigned short) month;
         tp.year = (unsigned short) year;
-	}   
+}   
 
 
-	//you need to write the offset to port 0x70 then read the thing you want from port 0x71
-	char read_RTC_value(int offset){
+//you need to write the offset to port 0x70 then read the thing you want from port 0x71
+char CMOSRTC::read_RTC_value(int offset){
         UniqueIRQLock l;
-		__outb(0x70, offset);
-		return __inb(0x71);
-	}
+	__outb(0x70, offset);
+	return __inb(0x71);
+}
 
-	//read from status register A to see if an update is in progress
-    //returns 1 if update is in progress, 0 otherwise
-	int update_in_progress(){
-		__outb(0x70, 0x0A);
-		return (__inb(0x71) & 0x80); //0x80 is 10000000 in binary and we need to check the 7th bit in 0x0A
-	}
+//same as reading, but write the value to port 0x71 instead
+void CMOSRTC::write_RTC_value(int offset, uint8_t value){
+	UniqueIRQLock l;
+	__outb(0x70, offset);
+	__outb(0x71, value);
+}
 
+/**
+ * Reads and clears flags from status register C.  The register clears all of its
+ * flags when it is read, so flags that are not asked for are kept until they are.
+ * @param flags The flags to read.
+ * @return Returns which of the given flags have been set since they were last read.
+ */
+uint8_t CMOSRTC::read_status_flags(uint8_t flags)
+{
+	_status_flags |= (uint8_t)read_RTC_value(RTC_STATUS_C);
 
-};
+	uint8_t set = _status_flags & flags;
+	_status_flags &= ~flags;
+	return set;
+}
+
+//read from status register A to see if an update is in progress
+    //returns 1 if update is in progress, 0 otherwise
+int CMOSRTC::update_in_progress(){
+	__outb(0x70, 0x0A);
+	return (__inb(0x71) & 0x80); //0x80 is 10000000 in binary and we need to check the 7th bit in 0x0A
+}
 
 const DeviceClass CMOSRTC::CMOSRTCDeviceClass(RTC::RTCDeviceClass, "cmos-rtc");
 
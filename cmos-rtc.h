@@ -0,0 +1,227 @@
+/*
+ * CMOS Real-time Clock
+ *
+ * Besides the RTC interface, the CMOS RTC driver provides a nanosecond clock read from the TSC, and a
+ * timer wheel for alarms.  The kernel finds the driver through the device manager by its
+ * CMOSRTCDeviceClass, and uses these through it.
+ */
+#pragma once
+
+#include <infos/drivers/timer/rtc.h>
+
+// The timer wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots, each level covering WHEEL_SLOTS
+// times the span of the one below, so alarms up to 2^24 ticks away are kept without cascading.
+#define WHEEL_LEVELS		4
+#define WHEEL_BITS		6
+#define WHEEL_SLOTS		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SLOTS - 1)
+
+/**
+ * An alarm on a timer wheel.  Alarms are owned by their users, so arming and cancelling
+ * them never allocates.
+ */
+struct TimerAlarm {
+	TimerAlarm(void (*callback)(TimerAlarm *), void *data) : callback(callback), data(data), pending(false) { }
+
+	// Called once the alarm expires, after it has been taken off the wheel.
+	void (*callback)(TimerAlarm *alarm);
+	void *data;
+
+	// The tick the alarm expires at, and where it currently is on the wheel, or WHEEL_EXPIRED if it
+	// is waiting on the expired list for its callback to be run.
+	uint64_t expires;
+	bool pending;
+	uint8_t level;
+	uint8_t slot;
+	TimerAlarm *next;
+	TimerAlarm *prev;
+};
+
+/**
+ * A hierarchical timing wheel.  Alarms are kept on a doubly-linked list in the slot for
+ * their expiry tick, so arming and cancelling are O(1).  Alarms too far away for the
+ * bottom level are kept in a coarser slot of a higher level, and moved down a level
+ * (cascaded) when the wheel reaches the start of that slot.  Alarms that expire are moved
+ * to an expired list owned by the wheel, and stay pending until their callback is run, so
+ * they can still be re-armed or cancelled by the callbacks of alarms that expired with them.
+ */
+class TimerWheel {
+public:
+	TimerWheel();
+
+	/**
+	 * Returns the current tick of the wheel.
+	 */
+	uint64_t now() const { return _next - 1; }
+
+	/**
+	 * Arms an alarm, or re-arms it if it is already pending.
+	 * @param alarm The alarm to arm.
+	 * @param ticks How many ticks from now the alarm should expire.  Zero is treated as one,
+	 * since the current tick has already been processed.
+	 */
+	void add_alarm(TimerAlarm& alarm, uint64_t ticks);
+
+	/**
+	 * Disarms an alarm.
+	 * @param alarm The alarm to disarm.
+	 * @return Returns true if the alarm was pending, or false if its callback has already
+	 * been run or it was never armed.
+	 */
+	bool cancel_alarm(TimerAlarm& alarm);
+
+	/**
+	 * Moves the wheel on, and runs the callbacks of the alarms that expire, in the order they
+	 * expired.  The callbacks are run without the lock held, so they can re-arm or cancel any
+	 * alarm, including ones that expired in the same batch and have not been run yet.
+	 * @param ticks The number of ticks that have passed.
+	 */
+	void advance(uint64_t ticks);
+
+private:
+	void link_alarm(TimerAlarm *alarm);
+	void expire_alarm(TimerAlarm *alarm);
+	void unlink_alarm(TimerAlarm *alarm);
+	void cascade(unsigned int level, unsigned int slot);
+
+	// The next tick to be processed, so the current tick is one before it.
+	uint64_t _next;
+	unsigned int _nr_pending;
+	TimerAlarm *_slots[WHEEL_LEVELS][WHEEL_SLOTS];
+
+	// A bitmap of the slots on each level that have alarms in them.
+	uint64_t _occupied[WHEEL_LEVELS];
+
+	// Alarms that have expired and are waiting for their callbacks to be run, oldest first.
+	TimerAlarm *_expired_head;
+	TimerAlarm *_expired_tail;
+};
+
+class CMOSRTC : public infos::drivers::timer::RTC {
+public:
+	static const infos::drivers::DeviceClass CMOSRTCDeviceClass;
+
+	CMOSRTC();
+
+	const infos::drivers::DeviceClass& device_class() const override
+	{
+		return CMOSRTCDeviceClass;
+	}
+
+	/**
+	 * Initialises the device, measuring the TSC rate against the RTC so that the high-resolution
+	 * clocks are ready before anything reads them.  This busy-waits for up to two seconds, and
+	 * leaves the clocks reading zero if the RTC's updates are halted.  The rate is then measured
+	 * again from the timer wheel, as the TSC drifts against the RTC.  With "rtc.bench=1" on the
+	 * kernel command line, the benchmark is then run.
+	 * @param dm The device manager.
+	 * @return Returns true, since the RTC is always present.
+	 */
+	bool init(infos::kernel::DeviceManager& dm) override;
+
+	/**
+	 * Returns the current date & time.  The RTC only changes its time registers in
+	 * an update cycle, so the last value read is returned unless an update has
+	 * finished since.
+	 * @param tp Populates the tp structure with the current data & time, as
+	 * given by the CMOS RTC device.
+	 */
+	void read_timepoint(infos::drivers::timer::RTCTimePoint& tp) override;
+
+	/**
+	 * Starts the RTC's periodic interrupt.
+	 * @param rate The rate select value, from 3 (8192Hz) to 15 (2Hz).  The interrupt
+	 * frequency is 32768 >> (rate - 1).
+	 */
+	void set_periodic_rate(uint8_t rate);
+
+	/**
+	 * Handles the RTC interrupt (IRQ 8), which must be acknowledged by reading status
+	 * register C.  Each periodic interrupt moves the timer wheel on by a tick.
+	 */
+	void handle_interrupt();
+
+	/**
+	 * Runs timed loops of clock reads, and logs the average and worst cost in cycles as "bench rtc"
+	 * lines.  The TSC clock is only measured once init() has calibrated it.
+	 * @param iterations The number of reads to time for each kind of read.
+	 */
+	void run_benchmark(unsigned int iterations);
+
+	/**
+	 * Returns the timer wheel driven by the periodic interrupt.  It can also be driven by
+	 * another tick source, by calling advance() on it instead.
+	 */
+	TimerWheel& timers() { return _timers; }
+
+	/**
+	 * Returns a high-resolution monotonic time, from the TSC scaled against the RTC.
+	 * @return Returns the number of nanoseconds since the TSC was calibrated, or zero if the
+	 * driver has not been initialised yet.
+	 */
+	uint64_t now_ns();
+
+	/**
+	 * Returns the wall-clock time with nanosecond resolution, without touching the RTC.
+	 * @return Returns the number of nanoseconds since 1970-01-01, in the RTC's timezone, or zero
+	 * if the driver has not been initialised yet.
+	 */
+	uint64_t wall_clock_ns();
+
+private:
+	/**
+	 * The scale and offset used to turn TSC readings into nanoseconds.  Readers retry if the
+	 * sequence number is odd or changes while they read, so they never take a lock.
+	 */
+	struct ClockRecord {
+		volatile uint32_t sequence;
+		uint64_t base_cycles;
+		uint64_t base_ns;
+		uint64_t mult;		// nanoseconds per cycle, in 32.32 fixed point
+		uint64_t wall_offset_ns;
+	};
+
+	static void drift_alarm_expired(TimerAlarm *alarm);
+
+	void calibrate_tsc();
+	void check_drift();
+	void read_clock(uint64_t& ns, uint64_t& wall_offset) const;
+	void write_clock(uint64_t base_cycles, uint64_t base_ns, uint64_t mult, uint64_t wall_offset_ns);
+	bool wait_for_update(infos::drivers::timer::RTCTimePoint& tp, uint64_t budget_cycles, uint64_t& edge_cycles, uint64_t& window_cycles);
+	uint64_t correct_drift(uint64_t edge_cycles, const infos::drivers::timer::RTCTimePoint& tp);
+	void read_hardware_timepoint(infos::drivers::timer::RTCTimePoint& tp);
+	char read_RTC_value(int offset);
+	void write_RTC_value(int offset, uint8_t value);
+	uint8_t read_status_flags(uint8_t flags);
+	int update_in_progress();
+
+	// The time read at the last update, which stays current until the next update ends.
+	infos::drivers::timer::RTCTimePoint _cached_timepoint;
+	bool _cache_valid;
+
+	// Flags read from status register C that have not been consumed yet.
+	uint8_t _status_flags;
+
+	ClockRecord _clock;
+	volatile bool _calibrated;
+
+	// The TSC reading when status register C was last read.
+	uint64_t _last_poll_cycles;
+
+	// How close two polls must be for an update edge between them to be used for drift correction.
+	uint64_t _edge_window_cycles;
+
+	// The update edge the TSC rate is next measured from.
+	uint64_t _anchor_cycles;
+	uint64_t _anchor_seconds;
+
+	TimerWheel _timers;
+
+	// Checks whether the TSC rate is due to be measured again, on ticks of the timer wheel.
+	TimerAlarm _drift_alarm;
+
+	// The monotonic time of the last check, and how many ticks it armed the alarm for, from which
+	// the length of a tick is measured.
+	uint64_t _drift_check_ns;
+	uint64_t _drift_check_ticks;
+};
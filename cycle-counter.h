@@ -0,0 +1,38 @@
+/*
+ * Cycle Counter and Latency Histograms
+ *
+ * Shared by the page allocator, the schedulers and the RTC driver, which all time themselves
+ * against the CPU's time-stamp counter.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+// The number of power-of-two buckets in a latency histogram.
+#define LATENCY_BUCKETS	32
+
+/**
+ * Reads the CPU's time-stamp counter.
+ */
+static inline uint64_t read_cycle_counter()
+{
+	uint32_t low, high;
+	asm volatile("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+}
+
+/**
+ * Records a duration in a histogram with LATENCY_BUCKETS power-of-two buckets.  Bucket N counts
+ * the durations between 2^N and 2^(N+1) cycles, and the last bucket also counts anything longer.
+ * @param histogram The histogram to update.
+ * @param cycles The duration, in cycles.
+ */
+static inline void record_latency(uint64_t *histogram, uint64_t cycles)
+{
+	int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+	if (bucket >= LATENCY_BUCKETS) {
+		bucket = LATENCY_BUCKETS - 1;
+	}
+
+	histogram[bucket]++;
+}
@@ -0,0 +1,398 @@
+/*
+ * Host benchmark for the buddy page allocator.  buddy.cpp is built unchanged against the mock
+ * kernel headers, and replays alloc/free traces against it.
+ *
+ * A trace is a text file with one operation per line:
+ *   a <id> <order>		allocate a block of 2^order pages, and call it <id>
+ *   f <id>			free the block called <id>
+ * Lines starting with '#' are ignored.  An id can be reused once its block has been freed.  The
+ * synthetic traces can be written out with --record, so that a run can be replayed exactly.
+ *
+ * For each trace this reports the operation rate, percentiles of the alloc and free latency in
+ * cycles, and how fragmented the free memory is once the trace has finished.
+ */
+#include "test.h"
+#include "buddy.cpp"
+
+#include <algorithm>
+#include <chrono>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+struct TraceOp
+{
+	bool alloc;
+	uint32_t id;
+	int order;
+};
+
+typedef std::vector<TraceOp> Trace;
+
+/**
+ * Builds traces out of allocations and frees, keeping track of which ids are live so that only
+ * live blocks are freed.
+ */
+class TraceBuilder
+{
+public:
+	TraceBuilder(Trace& trace) : _trace(trace) { }
+
+	uint32_t alloc(int order)
+	{
+		uint32_t id;
+		if (_free_ids.empty()) {
+			id = _orders.size();
+			_orders.push_back(order);
+		} else {
+			id = _free_ids.back();
+			_free_ids.pop_back();
+			_orders[id] = order;
+		}
+
+		_trace.push_back({ true, id, order });
+		return id;
+	}
+
+	void free(uint32_t id)
+	{
+		_trace.push_back({ false, id, _orders[id] });
+		_free_ids.push_back(id);
+	}
+
+private:
+	Trace& _trace;
+	std::vector<int> _orders;
+	std::vector<uint32_t> _free_ids;
+};
+
+/**
+ * Mostly single pages with some larger blocks, freed in random order, with the live set held at
+ * around a quarter of memory.
+ */
+static void build_random(Trace& trace, uint64_t ops, uint64_t nr_pages, TestRandom& random)
+{
+	TraceBuilder builder(trace);
+	std::vector<std::pair<uint32_t, int>> live;
+	uint64_t live_pages = 0;
+
+	for (uint64_t i = 0; i < ops; i++) {
+		bool full = live_pages > nr_pages / 4;
+		if (!live.empty() && (full || random.below(100) < 45)) {
+			unsigned int index = random.below(live.size());
+			builder.free(live[index].first);
+			live_pages -= 1ULL << live[index].second;
+
+			live[index] = live.back();
+			live.pop_back();
+		} else {
+			// Larger orders get rarer, up to order 10.
+			int order = random.below(100) < 70 ? 0 : 1 + __builtin_ctzll(random.next() | (1ULL << 9));
+			live.push_back(std::make_pair(builder.alloc(order), order));
+			live_pages += 1ULL << order;
+		}
+	}
+}
+
+/**
+ * Each block is freed straight after it is allocated.
+ */
+static void build_pairs(Trace& trace, uint64_t ops, TestRandom& random)
+{
+	TraceBuilder builder(trace);
+
+	for (uint64_t i = 0; i < ops / 2; i++) {
+		builder.free(builder.alloc(random.below(4)));
+	}
+}
+
+/**
+ * Batches of single pages are allocated, and then all freed.
+ */
+static void build_batch(Trace& trace, uint64_t ops)
+{
+	TraceBuilder builder(trace);
+	std::vector<uint32_t> batch;
+
+	for (uint64_t i = 0; i < ops / 1024; i++) {
+		for (unsigned int j = 0; j < 512; j++) {
+			batch.push_back(builder.alloc(0));
+		}
+
+		for (uint32_t id : batch) {
+			builder.free(id);
+		}
+
+		batch.clear();
+	}
+}
+
+/**
+ * Long-lived single pages are allocated in between short-lived order-4 blocks, which leaves the
+ * long-lived pages scattered across memory.  The free memory this leaves behind is what the
+ * fragmentation report measures.
+ */
+static void build_aging(Trace& trace, uint64_t ops, uint64_t nr_pages, TestRandom& random)
+{
+	TraceBuilder builder(trace);
+	std::vector<uint32_t> short_lived;
+	uint64_t long_lived_pages = 0;
+
+	for (uint64_t i = 0; i < ops; i++) {
+		if (random.below(100) < 10 && long_lived_pages < nr_pages / 8) {
+			builder.alloc(0);
+			long_lived_pages++;
+		} else if (short_lived.size() < 256 && random.below(2)) {
+			short_lived.push_back(builder.alloc(4));
+		} else if (!short_lived.empty()) {
+			unsigned int index = random.below(short_lived.size());
+			builder.free(short_lived[index]);
+
+			short_lived[index] = short_lived.back();
+			short_lived.pop_back();
+		}
+	}
+}
+
+static bool load_trace(const char *path, Trace& trace)
+{
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		perror(path);
+		return false;
+	}
+
+	std::vector<int> orders;
+	char line[128];
+
+	while (fgets(line, sizeof(line), file)) {
+		char kind;
+		unsigned int id;
+		int order = 0;
+
+		if (line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+
+		int fields = sscanf(line, "%c %u %d", &kind, &id, &order);
+		if ((kind == 'a' && fields == 3 && order >= 0 && order < MAX_ORDER) || (kind == 'f' && fields >= 2 && id < orders.size())) {
+			if (kind == 'a') {
+				if (id >= orders.size()) {
+					orders.resize(id + 1);
+				}
+
+				orders[id] = order;
+			}
+
+			trace.push_back({ kind == 'a', id, orders[id] });
+		} else {
+			fprintf(stderr, "%s: bad line: %s", path, line);
+			fclose(file);
+			return false;
+		}
+	}
+
+	fclose(file);
+	return true;
+}
+
+static void save_trace(const char *path, const Trace& trace)
+{
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		perror(path);
+		return;
+	}
+
+	for (const TraceOp& op : trace) {
+		if (op.alloc) {
+			fprintf(file, "a %u %d\n", op.id, op.order);
+		} else {
+			fprintf(file, "f %u\n", op.id);
+		}
+	}
+
+	fclose(file);
+}
+
+static uint64_t percentile(std::vector<uint64_t>& samples, double fraction)
+{
+	if (samples.empty()) {
+		return 0;
+	}
+
+	size_t index = (size_t)(fraction * (samples.size() - 1));
+	std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+	return samples[index];
+}
+
+/**
+ * Reports how much of the free memory could not be used for a block of the given order, from 0
+ * (all of it can) to 1 (none of it can).
+ */
+static double unusable_free_index(const BuddyPageAllocator::AllocatorStats& stats, int order)
+{
+	uint64_t free_pages = 0, usable_pages = 0;
+
+	for (int i = 0; i < MAX_ORDER; i++) {
+		uint64_t pages = stats.orders[i].free_blocks << i;
+		free_pages += pages;
+
+		if (i >= order) {
+			usable_pages += pages;
+		}
+	}
+
+	return free_pages ? 1.0 - (double)usable_pages / free_pages : 0;
+}
+
+static void replay(const char *name, const Trace& trace, uint64_t nr_pages)
+{
+	sys.mm().pgalloc().setup(nr_pages);
+
+	BuddyPageAllocator *allocator = new BuddyPageAllocator();
+	allocator->init(sys.mm().pgalloc().page_descriptors(), nr_pages);
+
+	std::vector<PageDescriptor *> blocks;
+	std::vector<uint64_t> alloc_cycles, free_cycles;
+	uint64_t failures = 0;
+
+	alloc_cycles.reserve(trace.size());
+	free_cycles.reserve(trace.size());
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (const TraceOp& op : trace) {
+		if (op.id >= blocks.size()) {
+			blocks.resize(op.id + 1);
+		}
+
+		if (op.alloc) {
+			uint64_t before = read_cycle_counter();
+			blocks[op.id] = allocator->alloc_pages(op.order);
+			alloc_cycles.push_back(read_cycle_counter() - before);
+
+			if (!blocks[op.id]) {
+				failures++;
+			}
+		} else if (blocks[op.id]) {
+			uint64_t before = read_cycle_counter();
+			allocator->free_pages(blocks[op.id], op.order);
+			free_cycles.push_back(read_cycle_counter() - before);
+
+			blocks[op.id] = NULL;
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	uint64_t ops = alloc_cycles.size() + free_cycles.size();
+
+	printf("bench buddy-host trace=%s pages=%lu ops=%lu ops_per_sec=%.0f failures=%lu\n",
+		name, nr_pages, ops, seconds > 0 ? ops / seconds : 0, failures);
+
+	const char *kinds[] = { "alloc", "free" };
+	std::vector<uint64_t> *samples[] = { &alloc_cycles, &free_cycles };
+	for (int i = 0; i < 2; i++) {
+		printf("  %s cycles: p50=%lu p90=%lu p99=%lu p999=%lu max=%lu\n", kinds[i],
+			percentile(*samples[i], 0.5), percentile(*samples[i], 0.9), percentile(*samples[i], 0.99),
+			percentile(*samples[i], 0.999), percentile(*samples[i], 1.0));
+	}
+
+	const BuddyPageAllocator::AllocatorStats& stats = allocator->stats();
+	uint64_t free_pages = 0;
+	int largest = -1;
+
+	for (int i = 0; i < MAX_ORDER; i++) {
+		free_pages += stats.orders[i].free_blocks << i;
+		if (stats.orders[i].free_blocks) {
+			largest = i;
+		}
+	}
+
+	printf("  fragmentation: free_pages=%lu largest_order=%d unusable_order4=%.3f unusable_order9=%.3f\n",
+		free_pages, largest, unusable_free_index(stats, 4), unusable_free_index(stats, 9));
+
+	delete allocator;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "usage: %s [--pages N] [--ops N] [--seed N] [--pattern random|pairs|batch|aging|all]\n"
+		"       [--trace FILE] [--record FILE]\n", program);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t nr_pages = 1 << 20, ops = 1000000, seed = 1;
+	std::string pattern = "all";
+	const char *trace_path = NULL, *record_path = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			usage(argv[0]);
+		}
+
+		if (arg == "--pages") {
+			nr_pages = strtoull(argv[++i], NULL, 0);
+		} else if (arg == "--ops") {
+			ops = strtoull(argv[++i], NULL, 0);
+		} else if (arg == "--seed") {
+			seed = strtoull(argv[++i], NULL, 0);
+		} else if (arg == "--pattern") {
+			pattern = argv[++i];
+		} else if (arg == "--trace") {
+			trace_path = argv[++i];
+		} else if (arg == "--record") {
+			record_path = argv[++i];
+		} else {
+			usage(argv[0]);
+		}
+	}
+
+	if (trace_path) {
+		Trace trace;
+		if (!load_trace(trace_path, trace)) {
+			return 1;
+		}
+
+		replay(trace_path, trace, nr_pages);
+		return 0;
+	}
+
+	const char *patterns[] = { "random", "pairs", "batch", "aging" };
+	bool ran = false;
+
+	for (const char *name : patterns) {
+		if (pattern != "all" && pattern != name) {
+			continue;
+		}
+
+		TestRandom random(seed);
+		Trace trace;
+
+		if (!strcmp(name, "random")) {
+			build_random(trace, ops, nr_pages, random);
+		} else if (!strcmp(name, "pairs")) {
+			build_pairs(trace, ops, random);
+		} else if (!strcmp(name, "batch")) {
+			build_batch(trace, ops);
+		} else {
+			build_aging(trace, ops, nr_pages, random);
+		}
+
+		if (record_path) {
+			save_trace(record_path, trace);
+		}
+
+		replay(name, trace, nr_pages);
+		ran = true;
+	}
+
+	if (!ran) {
+		usage(argv[0]);
+	}
+
+	return 0;
+}
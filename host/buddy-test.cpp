@@ -0,0 +1,709 @@
+/*
+ * Host tests for the buddy page allocator.  buddy.cpp is built unchanged against the mock kernel
+ * headers, and driven through its public interface.
+ */
+#include "test.h"
+#include "buddy.cpp"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/**
+ * Sets up a machine with the given number of pages, and a buddy allocator managing all of them.
+ */
+static BuddyPageAllocator *make_allocator(uint64_t nr_pages)
+{
+	sys.mm().pgalloc().setup(nr_pages);
+
+	BuddyPageAllocator *allocator = new BuddyPageAllocator();
+	allocator->init(sys.mm().pgalloc().page_descriptors(), nr_pages);
+	return allocator;
+}
+
+/**
+ * Returns the number of pages the allocator takes from a machine of the given size for its
+ * per-page free state.
+ */
+static uint64_t metadata_pages(uint64_t nr_pages)
+{
+	uint64_t bytes = nr_pages * (sizeof(uint32_t) + sizeof(int8_t)) + ((nr_pages + (1 << PAGEBLOCK_ORDER) - 1) >> PAGEBLOCK_ORDER);
+	return (bytes + PAGE_BYTES - 1) / PAGE_BYTES;
+}
+
+/**
+ * Returns the number of top-order blocks that are free on a machine of the given size, with no
+ * reservations.  The free state is taken from the top of memory.
+ */
+static uint64_t top_blocks(uint64_t nr_pages)
+{
+	const uint64_t top_pages = 1ULL << (MAX_ORDER - 1);
+	return (nr_pages - (metadata_pages(nr_pages) + top_pages - 1) / top_pages * top_pages) / top_pages;
+}
+
+static uint64_t pfn_of(const PageDescriptor *pgd)
+{
+	return sys.mm().pgalloc().pgd_to_pfn(pgd);
+}
+
+/**
+ * Marks the pages of a block as owned, and returns FALSE if any of them already were.
+ */
+static bool claim(std::vector<uint8_t>& owned, const PageDescriptor *pgd, int order)
+{
+	uint64_t pfn = pfn_of(pgd);
+	for (uint64_t i = 0; i < (1ULL << order); i++) {
+		if (owned[pfn + i]) {
+			return false;
+		}
+
+		owned[pfn + i] = 1;
+	}
+
+	return true;
+}
+
+static void release(std::vector<uint8_t>& owned, const PageDescriptor *pgd, int order)
+{
+	uint64_t pfn = pfn_of(pgd);
+	for (uint64_t i = 0; i < (1ULL << order); i++) {
+		owned[pfn + i] = 0;
+	}
+}
+
+/**
+ * Returns TRUE if every top-order block of a machine of the given size can be allocated, i.e. all
+ * of the free memory has been merged back together.  The blocks are freed again afterwards.
+ */
+static bool fully_merged(BuddyPageAllocator *allocator, uint64_t nr_pages)
+{
+	const int top = MAX_ORDER - 1;
+	std::vector<PageDescriptor *> blocks;
+
+	for (uint64_t i = 0; i <= top_blocks(nr_pages); i++) {
+		PageDescriptor *pgd = allocator->alloc_pages(top);
+		if (!pgd) {
+			break;
+		}
+
+		blocks.push_back(pgd);
+	}
+
+	for (PageDescriptor *pgd : blocks) {
+		allocator->free_pages(pgd, top);
+	}
+
+	return blocks.size() == top_blocks(nr_pages);
+}
+
+TEST(alloc_every_page)
+{
+	const uint64_t nr_pages = 1 << 18;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+	std::vector<uint8_t> owned(nr_pages);
+	std::vector<PageDescriptor *> pages;
+
+	while (PageDescriptor *pgd = allocator->alloc_pages(0)) {
+		CHECK(claim(owned, pgd, 0));
+		pages.push_back(pgd);
+	}
+
+	CHECK(pages.size() == nr_pages - metadata_pages(nr_pages));
+
+	for (PageDescriptor *pgd : pages) {
+		allocator->free_pages(pgd, 0);
+	}
+
+	CHECK(fully_merged(allocator, nr_pages));
+	delete allocator;
+}
+
+TEST(random_alloc_free)
+{
+	const uint64_t nr_pages = 1 << 18;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+	std::vector<uint8_t> owned(nr_pages);
+
+	struct Block { PageDescriptor *pgd; int order; };
+	std::vector<Block> live;
+	TestRandom random(1);
+
+	for (unsigned int op = 0; op < 200000; op++) {
+		if (live.empty() || random.below(100) < 55) {
+			int order = random.below(100) < 70 ? 0 : random.below(11);
+			PageDescriptor *pgd = allocator->alloc_pages(order);
+			if (!pgd) {
+				continue;
+			}
+
+			CHECK(pfn_of(pgd) % (1ULL << order) == 0);
+			CHECK(claim(owned, pgd, order));
+			live.push_back({ pgd, order });
+		} else {
+			unsigned int i = random.below(live.size());
+			release(owned, live[i].pgd, live[i].order);
+			allocator->free_pages(live[i].pgd, live[i].order);
+
+			live[i] = live.back();
+			live.pop_back();
+		}
+	}
+
+	for (const Block& block : live) {
+		allocator->free_pages(block.pgd, block.order);
+	}
+
+	CHECK(fully_merged(allocator, nr_pages));
+	delete allocator;
+}
+
+TEST(reserved_pages_are_never_allocated)
+{
+	const uint64_t nr_pages = 1 << 17;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+
+	CHECK(allocator->reserve_range(100, 1000));
+	CHECK(allocator->reserve_page(sys.mm().pgalloc().pfn_to_pgd(5000)));
+	CHECK(!allocator->reserve_range(1000, 10));
+
+	uint64_t count = 0;
+	while (PageDescriptor *pgd = allocator->alloc_pages(0)) {
+		uint64_t pfn = pfn_of(pgd);
+		CHECK(pfn < 100 || pfn >= 1100);
+		CHECK(pfn != 5000);
+		count++;
+	}
+
+	CHECK(count == nr_pages - 1001 - metadata_pages(nr_pages));
+	delete allocator;
+}
+
+TEST(bulk_alloc_free)
+{
+	const uint64_t nr_pages = 1 << 17;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+	std::vector<uint8_t> owned(nr_pages);
+
+	for (int order = 0; order < 4; order++) {
+		PageDescriptor *blocks[300];
+		unsigned int count = allocator->alloc_pages_bulk(order, 300, blocks);
+		CHECK(count == 300);
+
+		for (unsigned int i = 0; i < count; i++) {
+			CHECK(pfn_of(blocks[i]) % (1ULL << order) == 0);
+			CHECK(claim(owned, blocks[i], order));
+		}
+
+		allocator->free_pages_bulk(blocks, count, order);
+		for (unsigned int i = 0; i < count; i++) {
+			release(owned, blocks[i], order);
+		}
+	}
+
+	CHECK(fully_merged(allocator, nr_pages));
+	delete allocator;
+}
+
+TEST(dma32_allocations_stay_below_4gb)
+{
+	const uint64_t nr_pages = DMA32_LIMIT_PFN + (1 << 18);
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+
+	for (int i = 0; i < 1000; i++) {
+		PageDescriptor *pgd = allocator->alloc_pages(i % 4, MigrateType::UNMOVABLE, Zone::DMA32);
+		CHECK(pgd);
+		CHECK(pfn_of(pgd) < DMA32_LIMIT_PFN);
+	}
+
+	PageDescriptor *pgd = allocator->alloc_pages(2, MigrateType::UNMOVABLE, Zone::NORMAL);
+	CHECK(pgd && pfn_of(pgd) >= DMA32_LIMIT_PFN);
+	delete allocator;
+}
+
+static uint64_t total_splits(BuddyPageAllocator *allocator)
+{
+	uint64_t splits = 0;
+	for (int i = 0; i < MAX_ORDER; i++) {
+		splits += allocator->stats().orders[i].splits;
+	}
+
+	return splits;
+}
+
+TEST(bulk_alloc_falls_back_to_dma32)
+{
+	// A 1GB machine has no normal memory, so normal bulk allocations are served from DMA32.
+	const uint64_t nr_pages = 1 << 18;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+	std::vector<uint8_t> owned(nr_pages);
+
+	PageDescriptor *blocks[256];
+	uint64_t splits = total_splits(allocator);
+
+	CHECK(allocator->alloc_pages_bulk(0, 256, blocks) == 256);
+	for (unsigned int i = 0; i < 256; i++) {
+		CHECK(claim(owned, blocks[i], 0));
+	}
+
+	// Carving the batch out of one large block splits it a handful of times, rather than once
+	// per page.
+	CHECK(total_splits(allocator) - splits < 32);
+	delete allocator;
+}
+
+TEST(normal_allocations_leave_lowmem_reserve)
+{
+	const uint64_t nr_pages = DMA32_LIMIT_PFN + (1 << 17);
+	const uint64_t reserve = ((1 << 17) - metadata_pages(nr_pages)) / LOWMEM_RESERVE_RATIO;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+
+	// Free some DMA32 pages, which go straight back to the free areas rather than being held where
+	// normal allocations could take them without checking the reserve.
+	std::vector<PageDescriptor *> dma32_pages;
+	for (int i = 0; i < 1000; i++) {
+		dma32_pages.push_back(allocator->alloc_pages(0, MigrateType::UNMOVABLE, Zone::DMA32));
+	}
+
+	for (PageDescriptor *pgd : dma32_pages) {
+		allocator->free_pages(pgd, 0);
+	}
+
+	// Bulk and single normal allocations both fall back to DMA32 once the normal zone runs out, but
+	// must stop at the reserve.
+	std::vector<PageDescriptor *> blocks(4096);
+	while (allocator->alloc_pages_bulk(0, blocks.size(), blocks.data()) == blocks.size());
+	while (allocator->alloc_pages(0));
+
+	uint64_t dma32_left = 0;
+	while (allocator->alloc_pages(0, MigrateType::UNMOVABLE, Zone::DMA32)) {
+		dma32_left++;
+	}
+
+	CHECK(dma32_left >= reserve);
+	delete allocator;
+}
+
+TEST(migrate_types_are_kept_in_separate_pageblocks)
+{
+	const uint64_t nr_pages = 1 << 17;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+	std::vector<PageDescriptor *> blocks[MIGRATE_TYPES];
+	std::vector<int> pageblock_owner(nr_pages >> PAGEBLOCK_ORDER, -1);
+
+	// Every pageblock starts out unmovable, so the other types claim pageblocks of their own as they
+	// go, rather than being mixed in with the unmovable pages.
+	for (int i = 0; i < 600; i++) {
+		for (int type = 0; type < MIGRATE_TYPES; type++) {
+			PageDescriptor *pgd = allocator->alloc_pages(1, (MigrateType::MigrateType)type);
+			CHECK(pgd);
+			CHECK(allocator->page_migrate_type(pgd) == type);
+
+			int& owner = pageblock_owner[pfn_of(pgd) >> PAGEBLOCK_ORDER];
+			CHECK(owner == -1 || owner == type);
+			owner = type;
+
+			blocks[type].push_back(pgd);
+		}
+	}
+
+	CHECK(allocator->check_free_areas());
+
+	for (int type = 0; type < MIGRATE_TYPES; type++) {
+		for (PageDescriptor *pgd : blocks[type]) {
+			allocator->free_pages(pgd, 1);
+		}
+	}
+
+	// Pageblocks keep the type they were claimed for, but the blocks freed into them still merge
+	// back into blocks that any type can have.
+	CHECK(allocator->check_free_areas());
+	CHECK(fully_merged(allocator, nr_pages));
+	delete allocator;
+}
+
+TEST(fallback_borrows_small_blocks_and_claims_pageblocks)
+{
+	const uint64_t nr_pages = 1 << 13;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+	std::vector<PageDescriptor *> by_pfn(nr_pages);
+
+	// Use up all of memory as unmovable pairs of pages.
+	while (PageDescriptor *pgd = allocator->alloc_pages(1, MigrateType::UNMOVABLE)) {
+		by_pfn[pfn_of(pgd)] = pgd;
+	}
+
+	// Free every fourth pair in the first half of one pageblock.  Their buddies are still in use, so
+	// they stay as small blocks.
+	const uint64_t base = 2 << PAGEBLOCK_ORDER;
+	const uint64_t half = 1 << (PAGEBLOCK_ORDER - 1);
+	for (uint64_t pfn = base; pfn < base + half; pfn += 8) {
+		allocator->free_pages(by_pfn[pfn], 1);
+	}
+
+	// Movable allocations have nowhere else to go, so they borrow those blocks, and the pageblock
+	// stays unmovable.
+	PageDescriptor *borrowed = allocator->alloc_pages(1, MigrateType::MOVABLE);
+	CHECK(borrowed && pfn_of(borrowed) >= base && pfn_of(borrowed) < base + half);
+	CHECK(allocator->page_migrate_type(borrowed) == MigrateType::UNMOVABLE);
+	CHECK(allocator->check_free_areas());
+
+	// Free the second half of the pageblock, which merges into one large block.  The next movable
+	// allocation claims the whole pageblock, including the small blocks still free in it.
+	for (uint64_t pfn = base + half; pfn < base + 2 * half; pfn += 2) {
+		allocator->free_pages(by_pfn[pfn], 1);
+	}
+
+	uint64_t free_pages = half + (half / 8 - 1) * 2;
+	PageDescriptor *claimed = allocator->alloc_pages(1, MigrateType::MOVABLE);
+	CHECK(claimed && pfn_of(claimed) >= base && pfn_of(claimed) < base + 2 * half);
+	CHECK(allocator->page_migrate_type(claimed) == MigrateType::MOVABLE);
+	CHECK(allocator->check_free_areas());
+
+	// Every free page left in the pageblock is now on the movable lists, and nothing else is free.
+	uint64_t nr_claimed = 1;
+	while (PageDescriptor *pgd = allocator->alloc_pages(1, MigrateType::MOVABLE)) {
+		CHECK(pfn_of(pgd) >= base && pfn_of(pgd) < base + 2 * half);
+		nr_claimed++;
+	}
+
+	CHECK(nr_claimed == free_pages / 2);
+	CHECK(!allocator->alloc_pages(1, MigrateType::UNMOVABLE));
+	CHECK(allocator->check_free_areas());
+	delete allocator;
+}
+
+TEST(large_claims_retype_only_the_pageblocks_needed)
+{
+	const uint64_t nr_pages = 1 << 17;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+
+	// A reclaimable block larger than a pageblock claims exactly the pageblocks it covers, out of the
+	// much larger unmovable block it is split from.
+	const int order = PAGEBLOCK_ORDER + 1;
+	PageDescriptor *block = allocator->alloc_pages(order, MigrateType::RECLAIMABLE);
+	CHECK(block && pfn_of(block) % (1ULL << order) == 0);
+
+	uint64_t nr_reclaimable = 0;
+	for (uint64_t pfn = 0; pfn < nr_pages; pfn += 1 << PAGEBLOCK_ORDER) {
+		PageDescriptor *pgd = sys.mm().pgalloc().pfn_to_pgd(pfn);
+		bool inside = pgd >= block && pgd < block + (1 << order);
+
+		CHECK((allocator->page_migrate_type(pgd) == MigrateType::RECLAIMABLE) == inside);
+		nr_reclaimable += inside;
+	}
+
+	CHECK(nr_reclaimable == 1 << (order - PAGEBLOCK_ORDER));
+	CHECK(allocator->check_free_areas());
+
+	// Once freed, the block can be stolen back for a large unmovable allocation.
+	allocator->free_pages(block, order);
+	CHECK(allocator->check_free_areas());
+	CHECK(fully_merged(allocator, nr_pages));
+	CHECK(allocator->check_free_areas());
+	delete allocator;
+}
+
+TEST(zeroed_pages)
+{
+	const uint64_t nr_pages = 1 << 16;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+
+	std::vector<PageDescriptor *> pages;
+	for (int i = 0; i < 100; i++) {
+		PageDescriptor *pgd = allocator->alloc_pages(0);
+		memset(sys.mm().pgalloc().pgd_to_vpa(pgd), 0xa5, PAGE_BYTES);
+		pages.push_back(pgd);
+	}
+
+	for (PageDescriptor *pgd : pages) {
+		allocator->free_pages(pgd, 0);
+	}
+
+	CHECK(allocator->refill_zero_pool(50) == 50);
+
+	for (int i = 0; i < 200; i++) {
+		PageDescriptor *pgd = allocator->alloc_zeroed_pages(i % 2);
+		const uint8_t *bytes = (const uint8_t *)sys.mm().pgalloc().pgd_to_vpa(pgd);
+
+		for (uint64_t j = 0; j < ((uint64_t)PAGE_BYTES << (i % 2)); j++) {
+			CHECK(bytes[j] == 0);
+		}
+	}
+
+	delete allocator;
+}
+
+TEST(freed_pages_top_up_the_zeroed_pool)
+{
+	const uint64_t nr_pages = 1 << 16;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+
+	std::vector<PageDescriptor *> pages;
+	for (int i = 0; i < ZERO_POOL_LOW * 2; i++) {
+		PageDescriptor *pgd = allocator->alloc_pages(0);
+		memset(sys.mm().pgalloc().pgd_to_vpa(pgd), 0xa5, PAGE_BYTES);
+		pages.push_back(pgd);
+	}
+
+	// Only the frees up to the low mark pay for zeroing.
+	for (PageDescriptor *pgd : pages) {
+		allocator->free_pages(pgd, 0);
+	}
+
+	CHECK(allocator->refill_zero_pool(ZERO_POOL_HIGH) == ZERO_POOL_HIGH - ZERO_POOL_LOW);
+
+	for (int i = 0; i < ZERO_POOL_HIGH; i++) {
+		const uint8_t *bytes = (const uint8_t *)sys.mm().pgalloc().pgd_to_vpa(allocator->alloc_zeroed_pages(0));
+
+		for (uint64_t j = 0; j < PAGE_BYTES; j++) {
+			CHECK(bytes[j] == 0);
+		}
+	}
+
+	delete allocator;
+}
+
+TEST(lazy_coalescing)
+{
+	const uint64_t nr_pages = 1 << 17;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+	allocator->set_lazy_coalescing(true);
+
+	std::vector<PageDescriptor *> blocks;
+	while (PageDescriptor *pgd = allocator->alloc_pages(2)) {
+		blocks.push_back(pgd);
+	}
+
+	CHECK(blocks.size() == (nr_pages - metadata_pages(nr_pages)) >> 2);
+
+	for (PageDescriptor *pgd : blocks) {
+		allocator->free_pages(pgd, 2);
+	}
+
+	// The freed blocks are merged once a larger block is needed.
+	CHECK(fully_merged(allocator, nr_pages));
+	delete allocator;
+}
+
+TEST(command_line_switch_enables_lazy_coalescing)
+{
+	const uint64_t nr_pages = 1 << 14;
+
+	for (int lazy = 0; lazy < 2; lazy++) {
+		CHECK(set_cmdline_argument("pgalloc.lazy", lazy ? "1" : "0"));
+		BuddyPageAllocator *allocator = make_allocator(nr_pages);
+		set_cmdline_argument("pgalloc.lazy", "0");
+
+		// A pair of buddies is merged when the second one is freed, unless merging is left until later.
+		PageDescriptor *a = allocator->alloc_pages(2);
+		PageDescriptor *b = allocator->alloc_pages(2);
+		CHECK(b == a + 4 || a == b + 4);
+
+		allocator->free_pages(a, 2);
+		allocator->free_pages(b, 2);
+
+		uint64_t merges = 0;
+		for (int i = 0; i < MAX_ORDER; i++) {
+			merges += allocator->stats().orders[i].merges;
+		}
+
+		CHECK(lazy ? merges == 0 : merges > 0);
+		delete allocator;
+	}
+}
+
+TEST(manages_more_than_8gb)
+{
+	const uint64_t nr_pages = 3 << 20;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+	uint64_t count = 0;
+
+	while (allocator->alloc_pages(MAX_ORDER - 1)) {
+		count += 1ULL << (MAX_ORDER - 1);
+	}
+
+	while (allocator->alloc_pages(0)) {
+		count++;
+	}
+
+	// Normal allocations leave the DMA32 reserve alone, so take that explicitly.
+	while (allocator->alloc_pages(0, MigrateType::UNMOVABLE, Zone::DMA32)) {
+		count++;
+	}
+
+	CHECK(count == nr_pages - metadata_pages(nr_pages));
+	delete allocator;
+}
+
+TEST(free_state_avoids_early_reservations)
+{
+	const uint64_t nr_pages = 1 << 17;
+	const uint64_t reserved = nr_pages - 1000;
+	sys.mm().pgalloc().setup(nr_pages);
+
+	BuddyPageAllocator *allocator = new BuddyPageAllocator();
+	allocator->init(sys.mm().pgalloc().page_descriptors(), nr_pages);
+
+	// Reserve the top of memory, and everything below the first 1000 pages, before first use.  The
+	// free state does not fit in the unreserved pages at the top, so it must go at the bottom.
+	uint8_t *memory = (uint8_t *)sys.mm().pgalloc().pgd_to_vpa(sys.mm().pgalloc().pfn_to_pgd(0));
+	memset(memory + (1000 << 12), 0x5a, (nr_pages - 1000) << 12);
+
+	CHECK(allocator->reserve_range(1000, reserved - 1000 - 10));
+	CHECK(allocator->reserve_range(reserved, nr_pages - reserved));
+	CHECK(!allocator->reserve_page(sys.mm().pgalloc().pfn_to_pgd(reserved)));
+
+	uint64_t count = 0;
+	while (PageDescriptor *pgd = allocator->alloc_pages(0)) {
+		CHECK(pfn_of(pgd) < 1000 || (pfn_of(pgd) >= reserved - 10 && pfn_of(pgd) < reserved));
+		count++;
+	}
+
+	CHECK(count == 1010 - metadata_pages(nr_pages));
+
+	for (uint64_t i = 1000 << 12; i < nr_pages << 12; i++) {
+		if (i >= (reserved - 10) << 12 && i < reserved << 12) {
+			continue;
+		}
+
+		CHECK(memory[i] == 0x5a);
+	}
+
+	delete allocator;
+}
+
+TEST(command_line_benchmark_leaves_state_alone)
+{
+	const uint64_t nr_pages = 1 << 18;
+
+	CHECK(set_cmdline_argument("pgalloc.bench", "1"));
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+	set_cmdline_argument("pgalloc.bench", "0");
+
+	CHECK(allocator->refill_zero_pool(10) == 10);
+
+	// The benchmark runs on the first allocation, and only that allocation is counted.
+	unsigned int messages = mm_log.nr_messages;
+	CHECK(allocator->alloc_pages(0));
+	CHECK(mm_log.nr_messages > messages);
+
+	uint64_t allocs = 0, frees = 0, failures = 0;
+	for (int i = 0; i < MAX_ORDER; i++) {
+		allocs += allocator->stats().orders[i].allocs;
+		frees += allocator->stats().orders[i].frees;
+		failures += allocator->stats().orders[i].failures;
+	}
+
+	CHECK(allocs == 1 && frees == 0 && failures == 0);
+
+	// The zeroed pages were not handed back to the free areas.
+	CHECK(allocator->refill_zero_pool(ZERO_POOL_HIGH) == ZERO_POOL_HIGH - 10);
+
+	// It only runs once.
+	messages = mm_log.nr_messages;
+	CHECK(allocator->alloc_pages(0));
+	CHECK(mm_log.nr_messages == messages);
+	delete allocator;
+}
+
+TEST(benchmark_fits_in_small_machines)
+{
+	// A whole batch of order-10 blocks would be 512MB, and this machine has 32MB.
+	const uint64_t nr_pages = 1 << 13;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+
+	CHECK(allocator->run_benchmark(BENCH_MAX_ORDER, 2) == 0);
+
+	// Everything the benchmark allocated was given back.
+	uint64_t count = 0;
+	while (allocator->alloc_pages(0)) {
+		count++;
+	}
+
+	CHECK(count == nr_pages - metadata_pages(nr_pages));
+	delete allocator;
+}
+
+TEST(dump_state_logs_without_the_lock)
+{
+	const uint64_t nr_pages = 1 << 14;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+
+	PageDescriptor *pgd = allocator->alloc_pages(0);
+	allocator->free_pages(pgd, 0);
+
+	unsigned int messages = mm_log.nr_messages, locked_messages = mm_log.nr_locked_messages;
+	allocator->dump_state();
+
+	// A line for each order, and the zone and cache lines, all logged with interrupts enabled.
+	CHECK(mm_log.nr_messages - messages >= 1 + MAX_ORDER + 5);
+	CHECK(mm_log.nr_locked_messages == locked_messages);
+	delete allocator;
+}
+
+TEST(concurrent_alloc_free)
+{
+	const uint64_t nr_pages = 1 << 16;
+	const unsigned int nr_threads = 4;
+	BuddyPageAllocator *allocator = make_allocator(nr_pages);
+
+	// Each page is owned by at most one thread at a time, or the allocator has handed it out twice.
+	std::vector<std::atomic<uint8_t>> owned(nr_pages);
+	std::atomic<bool> overlap(false);
+	std::vector<std::thread> threads;
+
+	for (unsigned int t = 0; t < nr_threads; t++) {
+		threads.emplace_back([&, t]() {
+			TestRandom random(t + 1);
+			std::vector<std::pair<PageDescriptor *, int>> live;
+
+			for (unsigned int op = 0; op < 50000; op++) {
+				if (live.size() < 64 && (live.empty() || random.below(2))) {
+					int order = random.below(4);
+					PageDescriptor *pgd = allocator->alloc_pages(order);
+					if (!pgd) {
+						continue;
+					}
+
+					for (uint64_t i = 0; i < (1ULL << order); i++) {
+						if (owned[pfn_of(pgd) + i].exchange(1)) {
+							overlap = true;
+						}
+					}
+
+					live.push_back(std::make_pair(pgd, order));
+				} else {
+					unsigned int index = random.below(live.size());
+					for (uint64_t i = 0; i < (1ULL << live[index].second); i++) {
+						owned[pfn_of(live[index].first) + i] = 0;
+					}
+
+					allocator->free_pages(live[index].first, live[index].second);
+					live[index] = live.back();
+					live.pop_back();
+				}
+			}
+
+			for (const auto& block : live) {
+				for (uint64_t i = 0; i < (1ULL << block.second); i++) {
+					owned[pfn_of(block.first) + i] = 0;
+				}
+
+				allocator->free_pages(block.first, block.second);
+			}
+		});
+	}
+
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	CHECK(!overlap);
+	CHECK(fully_merged(allocator, nr_pages));
+	delete allocator;
+}
+
+int main(int argc, char **argv)
+{
+	return run_tests(argc, argv);
+}
@@ -0,0 +1,32 @@
+/*
+ * Host mock of <arch/x86/pio.h>.  The only device behind the ports is the CMOS RTC at 0x70/0x71,
+ * which is modelled on a simulated clock that starts at the host's time: the time registers read
+ * its UTC time in binary 24-hour mode, and status register C reports an ended update each time it
+ * reaches a new second, unless SET in status register B has halted updates.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace arch
+	{
+		namespace x86
+		{
+			void __outb(uint16_t port, uint8_t value);
+			uint8_t __inb(uint16_t port);
+		}
+	}
+}
+
+/**
+ * Returns the time of the simulated CMOS clock, in nanoseconds since 1970-01-01.  Host builds only.
+ */
+uint64_t cmos_simulated_ns();
+
+/**
+ * Makes the simulated CMOS clock run at the given multiple of the host's clock, so that tests can
+ * pass many RTC seconds quickly, or make the RTC drift against the TSC.  Host builds only.
+ */
+void set_cmos_time_scale(double scale);
@@ -0,0 +1,10 @@
+/*
+ * Host mock of <infos/define.h>, for building kernel components as ordinary programs.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(arr[0]))
@@ -0,0 +1,54 @@
+/*
+ * Host mock of <infos/drivers/device.h>.  Devices registered with RegisterDevice are recorded, so
+ * that host programs can create and initialise them.
+ */
+#pragma once
+
+#include <infos/define.h>
+#include <infos/kernel/device-manager.h>
+
+namespace infos
+{
+	namespace drivers
+	{
+		class DeviceClass
+		{
+		public:
+			DeviceClass(const char *name) : parent(NULL), name(name) { }
+			DeviceClass(const DeviceClass& parent, const char *name) : parent(&parent), name(name) { }
+
+			const DeviceClass *parent;
+			const char *name;
+		};
+
+		class Device
+		{
+		public:
+			static const DeviceClass RootDeviceClass;
+
+			virtual ~Device() { }
+
+			virtual const DeviceClass& device_class() const { return RootDeviceClass; }
+			virtual bool init(kernel::DeviceManager& dm) { return true; }
+		};
+
+		typedef Device *(*DeviceFactory)();
+
+		/**
+		 * Records a device registered with RegisterDevice.
+		 */
+		struct DeviceRegistration
+		{
+			DeviceRegistration(DeviceFactory factory);
+
+			DeviceFactory factory;
+			DeviceRegistration *next;
+
+			static DeviceRegistration *head;
+		};
+	}
+}
+
+#define RegisterDevice(_class) \
+	static infos::drivers::DeviceRegistration __device_registration_##_class( \
+		[]() -> infos::drivers::Device * { return new _class(); })
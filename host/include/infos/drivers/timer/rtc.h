@@ -0,0 +1,30 @@
+/*
+ * Host mock of <infos/drivers/timer/rtc.h>.
+ */
+#pragma once
+
+#include <infos/drivers/device.h>
+
+namespace infos
+{
+	namespace drivers
+	{
+		namespace timer
+		{
+			struct RTCTimePoint
+			{
+				unsigned short seconds, minutes, hours, day_of_month, month, year;
+			};
+
+			class RTC : public Device
+			{
+			public:
+				static const DeviceClass RTCDeviceClass;
+
+				const DeviceClass& device_class() const override { return RTCDeviceClass; }
+
+				virtual void read_timepoint(RTCTimePoint& tp) = 0;
+			};
+		}
+	}
+}
@@ -0,0 +1,38 @@
+/*
+ * Host mock of <infos/kernel/cmdline.h>.  Host programs hand arguments to the handlers registered
+ * with RegisterCmdLineArgument through set_cmdline_argument(), as the kernel does when it parses
+ * its command line.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		typedef void (*CmdLineArgumentHandler)(const char *value);
+
+		struct CmdLineArgumentRegistration
+		{
+			CmdLineArgumentRegistration(const char *name, CmdLineArgumentHandler handler);
+
+			const char *name;
+			CmdLineArgumentHandler handler;
+			CmdLineArgumentRegistration *next;
+
+			static CmdLineArgumentRegistration *head;
+		};
+
+		/**
+		 * Calls the handler of every argument registered with the given name.
+		 * @return Returns true if there was a handler for the argument.
+		 */
+		bool set_cmdline_argument(const char *name, const char *value);
+	}
+}
+
+#define RegisterCmdLineArgument(_name, _arg) \
+	static void __cmdline_handler_##_name(const char *value); \
+	static infos::kernel::CmdLineArgumentRegistration __cmdline_registration_##_name(_arg, __cmdline_handler_##_name); \
+	static void __cmdline_handler_##_name(const char *value)
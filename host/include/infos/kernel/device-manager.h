@@ -0,0 +1,15 @@
+/*
+ * Host mock of <infos/kernel/device-manager.h>.  Devices are handed one when they are initialised,
+ * but nothing is modelled behind it.
+ */
+#pragma once
+
+namespace infos
+{
+	namespace kernel
+	{
+		class DeviceManager
+		{
+		};
+	}
+}
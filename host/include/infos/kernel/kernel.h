@@ -0,0 +1,24 @@
+/*
+ * Host mock of <infos/kernel/kernel.h>.  Only the memory manager is modelled.
+ */
+#pragma once
+
+#include <infos/define.h>
+#include <infos/mm/mm.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		class Kernel
+		{
+		public:
+			mm::MemoryManager& mm() { return _mm; }
+
+		private:
+			mm::MemoryManager _mm;
+		};
+
+		extern Kernel sys;
+	}
+}
@@ -0,0 +1,44 @@
+/*
+ * Host mock of <infos/kernel/log.h>.  Messages go to stdout, apart from DEBUG messages, which are
+ * only printed when the HOST_LOG_DEBUG environment variable is set.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		namespace LogLevel
+		{
+			enum LogLevel {
+				DEBUG,
+				INFO,
+				WARNING,
+				ERROR,
+				FATAL,
+			};
+		}
+
+		class ComponentLog
+		{
+		public:
+			ComponentLog(const char *component) : nr_warnings(0), nr_messages(0), nr_locked_messages(0), _component(component) { }
+
+			void messagef(LogLevel::LogLevel level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+			// The number of messages logged at WARNING or above, so that tests can check for them.
+			unsigned int nr_warnings;
+
+			// The number of messages logged, and how many of them were logged with the IRQ lock held.
+			unsigned int nr_messages;
+			unsigned int nr_locked_messages;
+
+		private:
+			const char *_component;
+		};
+
+		extern ComponentLog syslog;
+	}
+}
@@ -0,0 +1,60 @@
+/*
+ * Host mock of <infos/kernel/sched.h>.  Host programs stand in for the kernel's CPU time
+ * accounting, by charging entities for the time they run.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		class SchedulingEntity
+		{
+		public:
+			typedef uint64_t EntityRuntime;
+
+			SchedulingEntity() : _cpu_runtime(0) { }
+			virtual ~SchedulingEntity() { }
+
+			EntityRuntime cpu_runtime() const { return _cpu_runtime; }
+
+			void charge(EntityRuntime delta) { _cpu_runtime += delta; }
+
+		private:
+			EntityRuntime _cpu_runtime;
+		};
+
+		class SchedulingAlgorithm
+		{
+		public:
+			virtual ~SchedulingAlgorithm() { }
+
+			virtual const char *name() const = 0;
+			virtual void add_to_runqueue(SchedulingEntity& entity) = 0;
+			virtual void remove_from_runqueue(SchedulingEntity& entity) = 0;
+			virtual SchedulingEntity *pick_next_entity() = 0;
+		};
+
+		typedef SchedulingAlgorithm *(*SchedulingAlgorithmFactory)();
+
+		/**
+		 * Records an algorithm registered with RegisterScheduler, so that host programs can create
+		 * instances of every registered algorithm.
+		 */
+		struct SchedulerRegistration
+		{
+			SchedulerRegistration(SchedulingAlgorithmFactory factory);
+
+			SchedulingAlgorithmFactory factory;
+			SchedulerRegistration *next;
+
+			static SchedulerRegistration *head;
+		};
+	}
+}
+
+#define RegisterScheduler(_class) \
+	static infos::kernel::SchedulerRegistration __scheduler_registration_##_class( \
+		[]() -> infos::kernel::SchedulingAlgorithm * { return new _class(); })
@@ -0,0 +1,6 @@
+/*
+ * Host mock of <infos/kernel/thread.h>.  Host programs model threads as plain scheduling entities.
+ */
+#pragma once
+
+#include <infos/kernel/sched.h>
@@ -0,0 +1,25 @@
+/*
+ * Host mock of <infos/mm/mm.h>.
+ */
+#pragma once
+
+#include <infos/define.h>
+#include <infos/kernel/log.h>
+#include <infos/mm/page-allocator.h>
+
+namespace infos
+{
+	namespace mm
+	{
+		class MemoryManager
+		{
+		public:
+			PageAllocator& pgalloc() { return _pgalloc; }
+
+		private:
+			PageAllocator _pgalloc;
+		};
+
+		extern kernel::ComponentLog mm_log;
+	}
+}
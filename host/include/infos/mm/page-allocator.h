@@ -0,0 +1,83 @@
+/*
+ * Host mock of <infos/mm/page-allocator.h>.  The mock page allocator owns an array of page
+ * descriptors, and a reserved (but mostly untouched) region of host memory standing in for
+ * physical memory, so that page frame numbers, descriptors and addresses translate the same way
+ * they do in the kernel.  Like the kernel's map of physical memory, the region starts on a 1GB
+ * boundary, so every block of pages is aligned to its size.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace mm
+	{
+		struct PageDescriptor
+		{
+			PageDescriptor *next_free;
+		};
+
+		class PageAllocatorAlgorithm
+		{
+		public:
+			virtual ~PageAllocatorAlgorithm() { }
+
+			virtual bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) = 0;
+			virtual PageDescriptor *alloc_pages(int order) = 0;
+			virtual void free_pages(PageDescriptor *pgd, int order) = 0;
+			virtual bool reserve_page(PageDescriptor *pgd) = 0;
+			virtual const char *name() const = 0;
+			virtual void dump_state() const = 0;
+		};
+
+		class PageAllocator
+		{
+		public:
+			PageAllocator() : _page_descriptors(NULL), _nr_pages(0), _memory(NULL), _mapping(NULL), _mapping_bytes(0) { }
+
+			/**
+			 * Sets up the page descriptors and backing memory for a machine with the given
+			 * number of pages of physical memory, throwing away any previous machine.
+			 */
+			void setup(uint64_t nr_pages);
+
+			PageDescriptor *page_descriptors() const { return _page_descriptors; }
+			uint64_t nr_pages() const { return _nr_pages; }
+
+			uint64_t pgd_to_pfn(const PageDescriptor *pgd) const { return pgd - _page_descriptors; }
+			PageDescriptor *pfn_to_pgd(uint64_t pfn) const { return &_page_descriptors[pfn]; }
+			void *pgd_to_vpa(const PageDescriptor *pgd) const { return _memory + (pgd_to_pfn(pgd) << 12); }
+
+		private:
+			PageDescriptor *_page_descriptors;
+			uint64_t _nr_pages;
+			uint8_t *_memory;
+
+			// The host mapping that _memory is aligned within.
+			void *_mapping;
+			size_t _mapping_bytes;
+		};
+
+		typedef PageAllocatorAlgorithm *(*PageAllocatorAlgorithmFactory)();
+
+		/**
+		 * Records an algorithm registered with RegisterPageAllocator, so that host programs can
+		 * create instances of it by name.
+		 */
+		struct PageAllocatorRegistration
+		{
+			PageAllocatorRegistration(const char *name, PageAllocatorAlgorithmFactory factory);
+
+			const char *name;
+			PageAllocatorAlgorithmFactory factory;
+			PageAllocatorRegistration *next;
+
+			static PageAllocatorRegistration *head;
+		};
+	}
+}
+
+#define RegisterPageAllocator(_class) \
+	static infos::mm::PageAllocatorRegistration __pgalloc_registration_##_class(#_class, \
+		[]() -> infos::mm::PageAllocatorAlgorithm * { return new _class(); })
@@ -0,0 +1,26 @@
+/*
+ * Host mock of <infos/util/lock.h>.  Host programs have no interrupts to mask, so the IRQ lock
+ * only counts how deep it is nested on the calling thread.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace util
+	{
+		extern thread_local unsigned int irq_lock_depth;
+
+		class UniqueIRQLock
+		{
+		public:
+			UniqueIRQLock() { irq_lock_depth++; }
+			~UniqueIRQLock() { irq_lock_depth--; }
+
+		private:
+			UniqueIRQLock(const UniqueIRQLock&) = delete;
+			UniqueIRQLock& operator=(const UniqueIRQLock&) = delete;
+		};
+	}
+}
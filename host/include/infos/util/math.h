@@ -0,0 +1,6 @@
+/*
+ * Host mock of <infos/util/math.h>.
+ */
+#pragma once
+
+#include <infos/define.h>
@@ -0,0 +1,6 @@
+/*
+ * Host mock of <infos/util/printf.h>.
+ */
+#pragma once
+
+#include <stdio.h>
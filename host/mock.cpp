@@ -0,0 +1,217 @@
+/*
+ * Host mocks of the kernel objects that the kernel components use.
+ */
+#include <infos/drivers/timer/rtc.h>
+#include <infos/kernel/cmdline.h>
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/log.h>
+#include <infos/kernel/sched.h>
+#include <infos/mm/mm.h>
+#include <infos/util/lock.h>
+#include <arch/x86/pio.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+using namespace infos::drivers;
+using namespace infos::drivers::timer;
+using namespace infos::kernel;
+using namespace infos::mm;
+
+thread_local unsigned int infos::util::irq_lock_depth;
+
+Kernel infos::kernel::sys;
+ComponentLog infos::kernel::syslog("sys");
+ComponentLog infos::mm::mm_log("mm");
+
+PageAllocatorRegistration *PageAllocatorRegistration::head;
+
+PageAllocatorRegistration::PageAllocatorRegistration(const char *name, PageAllocatorAlgorithmFactory factory)
+	: name(name), factory(factory), next(head)
+{
+	head = this;
+}
+
+const DeviceClass Device::RootDeviceClass("device");
+const DeviceClass RTC::RTCDeviceClass(Device::RootDeviceClass, "rtc");
+
+DeviceRegistration *DeviceRegistration::head;
+
+DeviceRegistration::DeviceRegistration(DeviceFactory factory) : factory(factory), next(head)
+{
+	head = this;
+}
+
+CmdLineArgumentRegistration *CmdLineArgumentRegistration::head;
+
+CmdLineArgumentRegistration::CmdLineArgumentRegistration(const char *name, CmdLineArgumentHandler handler)
+	: name(name), handler(handler), next(head)
+{
+	head = this;
+}
+
+bool infos::kernel::set_cmdline_argument(const char *name, const char *value)
+{
+	bool handled = false;
+
+	for (CmdLineArgumentRegistration *registration = CmdLineArgumentRegistration::head; registration; registration = registration->next) {
+		if (!strcmp(registration->name, name)) {
+			registration->handler(value);
+			handled = true;
+		}
+	}
+
+	return handled;
+}
+
+SchedulerRegistration *SchedulerRegistration::head;
+
+SchedulerRegistration::SchedulerRegistration(SchedulingAlgorithmFactory factory) : factory(factory), next(head)
+{
+	head = this;
+}
+
+void ComponentLog::messagef(LogLevel::LogLevel level, const char *format, ...)
+{
+	static const char *level_names[] = { "debug", "info", "warning", "error", "fatal" };
+
+	if (level >= LogLevel::WARNING) {
+		nr_warnings++;
+	}
+
+	nr_messages++;
+	if (infos::util::irq_lock_depth) {
+		nr_locked_messages++;
+	}
+
+	if (level == LogLevel::DEBUG && !getenv("HOST_LOG_DEBUG")) {
+		return;
+	}
+
+	va_list args;
+	va_start(args, format);
+
+	printf("%s: %s: ", _component, level_names[level]);
+	vprintf(format, args);
+	printf("\n");
+
+	va_end(args);
+}
+
+void PageAllocator::setup(uint64_t nr_pages)
+{
+	const size_t alignment = 1 << 30;
+
+	delete[] _page_descriptors;
+	if (_mapping) {
+		munmap(_mapping, _mapping_bytes);
+	}
+
+	_nr_pages = nr_pages;
+	_page_descriptors = new PageDescriptor[nr_pages]();
+
+	// Pages are only backed by host memory once they are touched, so large machines are cheap to
+	// model as long as the allocator does not write to every page.  The mapping is made larger than
+	// the machine, so that the machine's memory can start on an aligned address inside it.
+	_mapping_bytes = (nr_pages << 12) + alignment;
+	_mapping = mmap(NULL, _mapping_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (_mapping == MAP_FAILED) {
+		perror("mmap");
+		abort();
+	}
+
+	_memory = (uint8_t *)(((uintptr_t)_mapping + alignment - 1) & ~(uintptr_t)(alignment - 1));
+}
+
+// The CMOS register selected through port 0x70, the registers that software has written, and the
+// simulated second that status register C last reported an ended update for.
+static uint8_t cmos_index;
+static uint8_t cmos_registers[128];
+static uint64_t cmos_last_update;
+
+// The simulated clock runs at cmos_time_scale times the host's clock, from the host's time when it
+// was first read, and is rebased whenever the scale changes so that it never jumps.
+static double cmos_time_scale = 1;
+static uint64_t cmos_base_host_ns;
+static uint64_t cmos_base_ns;
+
+static uint64_t host_clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t cmos_simulated_ns()
+{
+	if (!cmos_base_host_ns) {
+		cmos_base_host_ns = host_clock_ns(CLOCK_MONOTONIC);
+		cmos_base_ns = host_clock_ns(CLOCK_REALTIME);
+	}
+
+	return cmos_base_ns + (uint64_t)((host_clock_ns(CLOCK_MONOTONIC) - cmos_base_host_ns) * cmos_time_scale);
+}
+
+void set_cmos_time_scale(double scale)
+{
+	cmos_base_ns = cmos_simulated_ns();
+	cmos_base_host_ns = host_clock_ns(CLOCK_MONOTONIC);
+	cmos_time_scale = scale;
+}
+
+void infos::arch::x86::__outb(uint16_t port, uint8_t value)
+{
+	if (port == 0x70) {
+		cmos_index = value & 0x7f;
+	} else if (port == 0x71) {
+		cmos_registers[cmos_index] = value;
+	}
+}
+
+uint8_t infos::arch::x86::__inb(uint16_t port)
+{
+	if (port != 0x71) {
+		return 0xff;
+	}
+
+	time_t now = cmos_simulated_ns() / 1000000000;
+	struct tm tm;
+	gmtime_r(&now, &tm);
+
+	switch (cmos_index) {
+	case 0x00:
+		return tm.tm_sec;
+	case 0x02:
+		return tm.tm_min;
+	case 0x04:
+		return tm.tm_hour;
+	case 0x07:
+		return tm.tm_mday;
+	case 0x08:
+		return tm.tm_mon + 1;
+	case 0x09:
+		return tm.tm_year % 100;
+	case 0x0a:
+		// An update is never in progress, since the host clock is read in one go.
+		return cmos_registers[0x0a] & 0x7f;
+	case 0x0b:
+		// The clock always runs in binary, 24-hour mode.
+		return cmos_registers[0x0b] | 0x06;
+	case 0x0c: {
+		// Setting SET in status register B halts updates.
+		if (cmos_registers[0x0b] & 0x80) {
+			return 0;
+		}
+
+		uint8_t flags = (uint64_t)now != cmos_last_update ? 0x10 : 0;
+		cmos_last_update = now;
+		return flags;
+	}
+	default:
+		return cmos_registers[cmos_index];
+	}
+}
@@ -0,0 +1,313 @@
+/*
+ * Host tests for the CMOS RTC driver's timer wheel.  cmos-rtc.cpp is built unchanged against the
+ * mock kernel headers, and the wheel is driven through its public interface.
+ */
+#include "test.h"
+#include "cmos-rtc.cpp"
+
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#define NOT_ARMED	(~0ULL)
+
+/**
+ * The alarms of a test, along with the tick each one is expected to expire at.
+ */
+struct AlarmSet
+{
+	AlarmSet(TimerWheel& wheel, unsigned int count) : wheel(wheel), expected(count, NOT_ARMED), runs(count, 0)
+	{
+		for (unsigned int i = 0; i < count; i++) {
+			alarms.push_back(new TimerAlarm(run_callback, this));
+		}
+	}
+
+	~AlarmSet()
+	{
+		for (TimerAlarm *alarm : alarms) {
+			delete alarm;
+		}
+	}
+
+	unsigned int index_of(TimerAlarm *alarm) const
+	{
+		for (unsigned int i = 0; i < alarms.size(); i++) {
+			if (alarms[i] == alarm) {
+				return i;
+			}
+		}
+
+		return alarms.size();
+	}
+
+	void add(unsigned int i, uint64_t ticks)
+	{
+		wheel.add_alarm(*alarms[i], ticks);
+		expected[i] = wheel.now() + (ticks ? ticks : 1);
+	}
+
+	bool cancel(unsigned int i)
+	{
+		expected[i] = NOT_ARMED;
+		return wheel.cancel_alarm(*alarms[i]);
+	}
+
+	static void run_callback(TimerAlarm *alarm)
+	{
+		AlarmSet *set = (AlarmSet *)alarm->data;
+		unsigned int i = set->index_of(alarm);
+
+		set->runs[i]++;
+		set->ran.push_back(i);
+
+		// Callbacks only run for alarms that are due, and only once.
+		if (alarm->pending || set->expected[i] > set->wheel.now()) {
+			set->bad_runs++;
+		}
+
+		set->expected[i] = NOT_ARMED;
+
+		if (set->on_run) {
+			set->on_run(*set, i);
+		}
+	}
+
+	TimerWheel& wheel;
+	std::vector<TimerAlarm *> alarms;
+	std::vector<uint64_t> expected;
+	std::vector<unsigned int> runs;
+	std::vector<unsigned int> ran;
+	unsigned int bad_runs = 0;
+
+	// Called from each callback, after it has been checked.
+	void (*on_run)(AlarmSet& set, unsigned int i) = NULL;
+
+	// Used by the callbacks of the stress test.
+	TestRandom *random = NULL;
+};
+
+TEST(alarms_expire_in_order)
+{
+	TimerWheel wheel;
+	AlarmSet set(wheel, 4);
+
+	set.add(0, 300);
+	set.add(1, 5);
+	set.add(2, 70);
+	set.add(3, 5);
+
+	wheel.advance(4);
+	CHECK(set.ran.empty());
+
+	wheel.advance(1);
+	CHECK(set.ran.size() == 2);
+
+	wheel.advance(400);
+	CHECK(set.ran.size() == 4);
+	CHECK(set.ran[2] == 2 && set.ran[3] == 0);
+	CHECK(!set.bad_runs);
+}
+
+TEST(callbacks_can_rearm_and_cancel_the_rest_of_their_batch)
+{
+	TimerWheel wheel;
+	AlarmSet set(wheel, 3);
+
+	// All three alarms expire on the same tick.  The callback that runs first re-arms the next
+	// alarm for later and cancels the last one, neither of which has been run yet.
+	set.on_run = [](AlarmSet& set, unsigned int i) {
+		if (set.ran.size() == 1) {
+			set.add((i + 1) % 3, 5);
+			CHECK(set.cancel((i + 2) % 3));
+		}
+	};
+
+	set.add(0, 3);
+	set.add(1, 3);
+	set.add(2, 3);
+
+	wheel.advance(3);
+	CHECK(set.ran.size() == 1);
+	unsigned int first = set.ran[0];
+
+	wheel.advance(4);
+	CHECK(set.ran.size() == 1);
+
+	wheel.advance(1);
+	CHECK(set.ran.size() == 2 && set.ran[1] == (first + 1) % 3);
+
+	wheel.advance(100);
+	CHECK(set.runs[(first + 2) % 3] == 0);
+	CHECK(!set.bad_runs);
+}
+
+TEST(callbacks_can_rearm_themselves)
+{
+	TimerWheel wheel;
+	AlarmSet set(wheel, 1);
+
+	set.on_run = [](AlarmSet& set, unsigned int i) {
+		if (set.runs[i] < 10) {
+			set.add(i, 7);
+		}
+	};
+
+	// Callbacks run once the wheel has been moved on, so it is moved a tick at a time, as the
+	// periodic interrupt would.
+	set.add(0, 7);
+	for (unsigned int tick = 0; tick < 1000; tick++) {
+		wheel.advance(1);
+	}
+
+	CHECK(set.runs[0] == 10);
+	CHECK(!set.bad_runs);
+}
+
+TEST(random_operations_match_a_reference_model)
+{
+	TimerWheel wheel;
+	AlarmSet set(wheel, 256);
+	TestRandom random(1);
+
+	// Callbacks re-arm or cancel a random alarm some of the time, which is often one that expired in
+	// the same batch and has not been run yet.
+	set.random = &random;
+	set.on_run = [](AlarmSet& set, unsigned int i) {
+		unsigned int other = set.random->below(set.alarms.size());
+
+		switch (set.random->below(4)) {
+		case 0:
+			set.add(other, set.random->below(100));
+			break;
+		case 1:
+			set.cancel(other);
+			break;
+		}
+	};
+
+	for (unsigned int op = 0; op < 200000; op++) {
+		unsigned int i = random.below(set.alarms.size());
+
+		switch (random.below(4)) {
+		case 0:
+		case 1: {
+			// Mostly near alarms, with some far enough away to be cascaded down several levels.
+			uint64_t range = random.below(8) ? 64 : 1 << 16;
+			set.add(i, random.below(range));
+			break;
+		}
+
+		case 2: {
+			bool armed = set.expected[i] != NOT_ARMED;
+			CHECK(set.cancel(i) == armed);
+			break;
+		}
+
+		case 3:
+			wheel.advance(1 + random.below(random.below(8) ? 8 : 256));
+
+			// Everything that was due has been run, unless a callback re-armed it.
+			for (unsigned int j = 0; j < set.alarms.size(); j++) {
+				CHECK(set.expected[j] == NOT_ARMED || set.expected[j] > wheel.now());
+				CHECK(set.alarms[j]->pending == (set.expected[j] != NOT_ARMED));
+			}
+
+			break;
+		}
+
+		CHECK(!set.bad_runs);
+	}
+
+	// Run everything that is still armed.
+	wheel.advance(1 << 17);
+	for (unsigned int j = 0; j < set.alarms.size(); j++) {
+		CHECK(set.expected[j] == NOT_ARMED || set.expected[j] > wheel.now());
+	}
+
+	CHECK(!set.bad_runs);
+}
+
+TEST(clocks_are_calibrated_by_init)
+{
+	CMOSRTC rtc;
+	DeviceManager dm;
+
+	// Reading the clocks never calibrates them, so they read zero until the driver is initialised.
+	CHECK(rtc.now_ns() == 0);
+	CHECK(rtc.wall_clock_ns() == 0);
+
+	// The host's CMOS ticks with its clock, so this takes up to two seconds.  The benchmark is run
+	// as well, since it is asked for on the command line.
+	set_cmdline_argument("rtc.bench", "1");
+	unsigned int messages = syslog.nr_messages;
+	CHECK(rtc.init(dm));
+	set_cmdline_argument("rtc.bench", "0");
+	// The calibrated rate, then a line for each kind of read.
+	CHECK(syslog.nr_messages - messages >= 4);
+
+	uint64_t first = rtc.now_ns();
+	uint64_t second = rtc.now_ns();
+	CHECK(second >= first);
+
+	int64_t wall_error = (int64_t)(rtc.wall_clock_ns() / NS_PER_SECOND) - (int64_t)(cmos_simulated_ns() / NS_PER_SECOND);
+	CHECK(wall_error >= -1 && wall_error <= 1);
+}
+
+TEST(halted_rtc_leaves_clocks_uncalibrated)
+{
+	CMOSRTC rtc;
+	DeviceManager dm;
+
+	// With SET in status register B, the RTC never updates, so init gives up straight away.
+	__outb(0x70, RTC_STATUS_B);
+	__outb(0x71, RTC_SET);
+
+	unsigned int warnings = syslog.nr_warnings;
+	time_t start = time(NULL);
+	CHECK(rtc.init(dm));
+	CHECK(time(NULL) - start <= 1);
+	CHECK(syslog.nr_warnings == warnings + 1);
+
+	__outb(0x70, RTC_STATUS_B);
+	__outb(0x71, 0);
+
+	CHECK(rtc.now_ns() == 0);
+	CHECK(rtc.wall_clock_ns() == 0);
+}
+
+TEST(drift_is_corrected_on_timer_ticks)
+{
+	CMOSRTC rtc;
+	DeviceManager dm;
+
+	// The RTC runs 64 times faster than the host, so a drift interval passes in about a second.
+	set_cmos_time_scale(64);
+	CHECK(rtc.init(dm));
+
+	// Once the TSC has been calibrated, the RTC's crystal runs 150ppm fast, which leaves the wall
+	// clock about 10ms behind by the time the rate is measured again.
+	set_cmos_time_scale(64 * 1.00015);
+
+	// The wheel is ticked every 32ms of RTC time, and the clocks are only corrected from its ticks.
+	uint64_t start = cmos_simulated_ns();
+	uint64_t last = rtc.now_ns();
+	while (cmos_simulated_ns() - start < (DRIFT_INTERVAL + 4) * NS_PER_SECOND) {
+		usleep(500);
+		rtc.timers().advance(1);
+
+		uint64_t now = rtc.now_ns();
+		CHECK(now >= last);
+		last = now;
+	}
+
+	int64_t wall_error = (int64_t)(rtc.wall_clock_ns() - cmos_simulated_ns());
+	CHECK(wall_error > -3000000 && wall_error < 3000000);
+
+	set_cmos_time_scale(1);
+}
+
+int main(int argc, char **argv)
+{
+	return run_tests(argc, argv);
+}
@@ -0,0 +1,323 @@
+/*
+ * Host scheduler simulator.  Every scheduling algorithm that is linked in and registered with
+ * RegisterScheduler is driven through a deterministic discrete-event simulation of a single CPU,
+ * running a mix of synthetic threads:
+ *   cpu	never blocks
+ *   io		runs for 0.2-1ms, then blocks for 5-15ms
+ *   bursty	runs for 20-60ms, then sleeps for 50-150ms
+ *
+ * A timer tick calls pick_next_entity() every millisecond, and so does every thread that blocks.
+ * Threads that wake up are put back on the runqueue straight away, and wait for the next pick.
+ *
+ * For each algorithm and mix this reports how many scheduling decisions are made per second of
+ * host time spent in pick_next_entity(), percentiles of the time threads spend waiting on the
+ * runqueue, how fairly the CPU-bound threads share the CPU, and the number of context switches.
+ */
+#include "test.h"
+
+#include <infos/kernel/sched.h>
+#include <infos/kernel/log.h>
+
+#include "cycle-counter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+using namespace infos::kernel;
+
+#define NS_PER_MS	1000000ULL
+
+namespace Workload {
+	enum Workload {
+		CPU,
+		IO,
+		BURSTY,
+	};
+}
+
+static const char *workload_names[] = { "cpu", "io", "bursty" };
+
+struct SimThread : public SchedulingEntity
+{
+	Workload::Workload workload;
+	bool runnable;
+
+	// How much longer the thread runs before it blocks, and when it wakes up once it has.
+	uint64_t burst_left;
+	uint64_t wake_time;
+
+	// When the thread last started waiting on the runqueue, and how long each wait lasted.
+	uint64_t wait_start;
+	std::vector<uint64_t> waits;
+};
+
+class Simulation
+{
+public:
+	Simulation(SchedulingAlgorithm& algorithm, uint64_t seed) : _algorithm(algorithm), _random(seed), _now(0), _current(NULL),
+		_decisions(0), _decision_cycles(0), _switches(0)
+	{
+	}
+
+	~Simulation()
+	{
+		for (SimThread *thread : _threads) {
+			delete thread;
+		}
+	}
+
+	void add_thread(Workload::Workload workload)
+	{
+		SimThread *thread = new SimThread();
+		thread->workload = workload;
+		thread->runnable = true;
+		thread->burst_left = next_burst(workload);
+		thread->wake_time = 0;
+		thread->wait_start = 0;
+
+		_threads.push_back(thread);
+		_algorithm.add_to_runqueue(*thread);
+	}
+
+	void run(uint64_t duration)
+	{
+		uint64_t next_tick = NS_PER_MS;
+
+		while (_now < duration) {
+			// Work out when the next thing happens: a tick, the running thread blocking, or a
+			// blocked thread waking up.
+			uint64_t next = next_tick;
+			if (_current && _current->workload != Workload::CPU && _now + _current->burst_left < next) {
+				next = _now + _current->burst_left;
+			}
+
+			for (SimThread *thread : _threads) {
+				if (!thread->runnable && thread->wake_time < next) {
+					next = thread->wake_time;
+				}
+			}
+
+			if (_current) {
+				_current->charge(next - _now);
+				if (_current->workload != Workload::CPU) {
+					_current->burst_left -= next - _now;
+				}
+			}
+
+			_now = next;
+
+			for (SimThread *thread : _threads) {
+				if (!thread->runnable && thread->wake_time <= _now) {
+					thread->runnable = true;
+					thread->burst_left = next_burst(thread->workload);
+					thread->wait_start = _now;
+					_algorithm.add_to_runqueue(*thread);
+				}
+			}
+
+			if (_current && _current->workload != Workload::CPU && !_current->burst_left) {
+				_current->runnable = false;
+				_current->wake_time = _now + next_sleep(_current->workload);
+				_algorithm.remove_from_runqueue(*_current);
+				_current = NULL;
+				schedule();
+			}
+
+			if (_now >= next_tick) {
+				next_tick += NS_PER_MS;
+				schedule();
+			}
+		}
+	}
+
+	/**
+	 * Prints the results of the run.
+	 * @param mix The name of the workload mix.
+	 * @param cycles_per_second The rate of the cycle counter, for turning cycles into host time.
+	 */
+	void report(const char *mix, double cycles_per_second) const
+	{
+		printf("bench sched-host algorithm=%s mix=%s threads=%zu decisions=%lu decisions_per_sec=%.0f switches=%lu fairness=%.3f\n",
+			_algorithm.name(), mix, _threads.size(), _decisions,
+			_decision_cycles ? _decisions * cycles_per_second / _decision_cycles : 0, _switches, fairness());
+
+		for (int workload = Workload::CPU; workload <= Workload::BURSTY; workload++) {
+			std::vector<uint64_t> waits;
+			for (const SimThread *thread : _threads) {
+				if (thread->workload == workload) {
+					waits.insert(waits.end(), thread->waits.begin(), thread->waits.end());
+				}
+			}
+
+			if (waits.empty()) {
+				continue;
+			}
+
+			std::sort(waits.begin(), waits.end());
+			printf("  %s wait us: n=%zu p50=%.1f p90=%.1f p99=%.1f max=%.1f\n", workload_names[workload], waits.size(),
+				waits[waits.size() / 2] / 1e3, waits[waits.size() * 9 / 10] / 1e3, waits[waits.size() * 99 / 100] / 1e3,
+				waits.back() / 1e3);
+		}
+	}
+
+	/**
+	 * Returns Jain's fairness index of the CPU time given to the CPU-bound threads, which is 1 when
+	 * they all got the same, down to 1/n when one thread got all of it.
+	 */
+	double fairness() const
+	{
+		double sum = 0, sum_squares = 0;
+		unsigned int n = 0;
+
+		for (const SimThread *thread : _threads) {
+			if (thread->workload == Workload::CPU) {
+				sum += thread->cpu_runtime();
+				sum_squares += (double)thread->cpu_runtime() * thread->cpu_runtime();
+				n++;
+			}
+		}
+
+		return sum_squares ? sum * sum / (n * sum_squares) : 1;
+	}
+
+private:
+	uint64_t next_burst(Workload::Workload workload)
+	{
+		switch (workload) {
+		case Workload::IO:
+			return 200000 + _random.below(800000);
+		case Workload::BURSTY:
+			return 20 * NS_PER_MS + _random.below(40 * NS_PER_MS);
+		default:
+			return 0;
+		}
+	}
+
+	uint64_t next_sleep(Workload::Workload workload)
+	{
+		if (workload == Workload::IO) {
+			return 5 * NS_PER_MS + _random.below(10 * NS_PER_MS);
+		}
+
+		return 50 * NS_PER_MS + _random.below(100 * NS_PER_MS);
+	}
+
+	void schedule()
+	{
+		uint64_t start = read_cycle_counter();
+		SimThread *next = static_cast<SimThread *>(_algorithm.pick_next_entity());
+		_decision_cycles += read_cycle_counter() - start;
+		_decisions++;
+
+		if (next == _current) {
+			return;
+		}
+
+		if (_current) {
+			_current->wait_start = _now;
+		}
+
+		if (next) {
+			next->waits.push_back(_now - next->wait_start);
+		}
+
+		_current = next;
+		_switches++;
+	}
+
+	SchedulingAlgorithm& _algorithm;
+	TestRandom _random;
+	std::vector<SimThread *> _threads;
+
+	uint64_t _now;
+	SimThread *_current;
+
+	uint64_t _decisions;
+	uint64_t _decision_cycles;
+	uint64_t _switches;
+};
+
+/**
+ * Measures how fast the cycle counter runs, against the host's monotonic clock.
+ */
+static double measure_cycles_per_second()
+{
+	auto start = std::chrono::steady_clock::now();
+	uint64_t start_cycles = read_cycle_counter();
+
+	while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(50));
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return (read_cycle_counter() - start_cycles) / seconds;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "usage: %s [--algorithm NAME] [--mix cpu|io|mixed|all] [--threads N] [--seconds N] [--seed N]\n", program);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	std::string algorithm_name, mix = "all";
+	unsigned int nr_threads = 64, seconds = 10;
+	uint64_t seed = 1;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			usage(argv[0]);
+		}
+
+		if (arg == "--algorithm") {
+			algorithm_name = argv[++i];
+		} else if (arg == "--mix") {
+			mix = argv[++i];
+		} else if (arg == "--threads") {
+			nr_threads = strtoul(argv[++i], NULL, 0);
+		} else if (arg == "--seconds") {
+			seconds = strtoul(argv[++i], NULL, 0);
+		} else if (arg == "--seed") {
+			seed = strtoull(argv[++i], NULL, 0);
+		} else {
+			usage(argv[0]);
+		}
+	}
+
+	const char *mixes[] = { "cpu", "io", "mixed" };
+	double cycles_per_second = measure_cycles_per_second();
+
+	for (SchedulerRegistration *registration = SchedulerRegistration::head; registration; registration = registration->next) {
+		for (const char *mix_name : mixes) {
+			if (mix != "all" && mix != mix_name) {
+				continue;
+			}
+
+			SchedulingAlgorithm *algorithm = registration->factory();
+			if (!algorithm_name.empty() && algorithm_name != algorithm->name()) {
+				delete algorithm;
+				break;
+			}
+
+			Simulation simulation(*algorithm, seed);
+			for (unsigned int i = 0; i < nr_threads; i++) {
+				if (!strcmp(mix_name, "cpu")) {
+					simulation.add_thread(Workload::CPU);
+				} else if (!strcmp(mix_name, "io")) {
+					simulation.add_thread(Workload::IO);
+				} else {
+					simulation.add_thread(i % 2 ? Workload::CPU : (i % 4 ? Workload::IO : Workload::BURSTY));
+				}
+			}
+
+			simulation.run((uint64_t)seconds * 1000 * NS_PER_MS);
+			simulation.report(mix_name, cycles_per_second);
+			delete algorithm;
+		}
+	}
+
+	return 0;
+}
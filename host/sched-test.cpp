@@ -0,0 +1,274 @@
+/*
+ * Host tests for the scheduling algorithms.  The schedulers are built unchanged against the mock
+ * kernel headers, and driven through the SchedulingAlgorithm interface.
+ */
+#include "test.h"
+#include "sched-rr.cpp"
+#include "sched-mlfq.cpp"
+
+#include <map>
+#include <vector>
+
+/**
+ * Picks the given number of times, charging each picked entity for a tick of CPU time, and counts
+ * how many times each entity was picked.
+ */
+static std::map<SchedulingEntity *, unsigned int> run_picks(SchedulingAlgorithm& algorithm, unsigned int picks, uint64_t tick)
+{
+	std::map<SchedulingEntity *, unsigned int> counts;
+
+	for (unsigned int i = 0; i < picks; i++) {
+		SchedulingEntity *entity = algorithm.pick_next_entity();
+		if (!entity) {
+			break;
+		}
+
+		counts[entity]++;
+		entity->charge(tick);
+	}
+
+	return counts;
+}
+
+TEST(rr_runs_every_entity_in_turn)
+{
+	RoundRobinScheduler scheduler;
+	std::vector<SchedulingEntity> entities(10);
+
+	for (SchedulingEntity& entity : entities) {
+		scheduler.add_to_runqueue(entity);
+	}
+
+	// Each pick uses up a whole quantum, so the entities are picked in turn.
+	std::map<SchedulingEntity *, unsigned int> counts = run_picks(scheduler, 1000, DEFAULT_QUANTUM);
+	CHECK(counts.size() == entities.size());
+
+	for (SchedulingEntity& entity : entities) {
+		CHECK(counts[&entity] == 100);
+	}
+}
+
+TEST(rr_keeps_entity_for_its_quantum)
+{
+	RoundRobinScheduler scheduler;
+	SchedulingEntity a, b;
+
+	scheduler.add_to_runqueue(a);
+	scheduler.add_to_runqueue(b);
+
+	SchedulingEntity *first = scheduler.pick_next_entity();
+	first->charge(DEFAULT_QUANTUM / 2);
+	CHECK(scheduler.pick_next_entity() == first);
+
+	first->charge(DEFAULT_QUANTUM / 2);
+	CHECK(scheduler.pick_next_entity() != first);
+}
+
+TEST(rr_removed_entities_are_not_picked)
+{
+	RoundRobinScheduler scheduler;
+	std::vector<SchedulingEntity> entities(8);
+
+	for (SchedulingEntity& entity : entities) {
+		scheduler.add_to_runqueue(entity);
+	}
+
+	for (unsigned int i = 0; i < entities.size(); i += 2) {
+		scheduler.remove_from_runqueue(entities[i]);
+	}
+
+	std::map<SchedulingEntity *, unsigned int> counts = run_picks(scheduler, 400, DEFAULT_QUANTUM);
+	CHECK(counts.size() == entities.size() / 2);
+
+	for (unsigned int i = 0; i < entities.size(); i += 2) {
+		CHECK(!counts.count(&entities[i]));
+	}
+
+	for (SchedulingEntity& entity : entities) {
+		scheduler.remove_from_runqueue(entity);
+	}
+
+	CHECK(!scheduler.pick_next_entity());
+}
+
+TEST(rr_turns_away_entities_beyond_the_pool)
+{
+	RoundRobinScheduler scheduler;
+	std::vector<SchedulingEntity> entities(RUNQUEUE_POOL_ENTRIES + 100);
+
+	// Nothing is allocated for the entities that do not fit, and they are reported once.
+	unsigned int warnings = syslog.nr_warnings;
+	for (SchedulingEntity& entity : entities) {
+		scheduler.add_to_runqueue(entity);
+	}
+
+	CHECK(syslog.nr_warnings == warnings + 1);
+
+	std::map<SchedulingEntity *, unsigned int> counts = run_picks(scheduler, entities.size(), DEFAULT_QUANTUM);
+	CHECK(counts.size() == RUNQUEUE_POOL_ENTRIES);
+	CHECK(!counts.count(&entities.back()));
+
+	// Once there is room, the entities that were turned away can be added.
+	for (unsigned int i = 0; i < 100; i++) {
+		scheduler.remove_from_runqueue(entities[i]);
+	}
+
+	for (unsigned int i = RUNQUEUE_POOL_ENTRIES; i < entities.size(); i++) {
+		scheduler.add_to_runqueue(entities[i]);
+	}
+
+	CHECK(syslog.nr_warnings == warnings + 1);
+
+	counts = run_picks(scheduler, entities.size(), DEFAULT_QUANTUM);
+	CHECK(counts.size() == RUNQUEUE_POOL_ENTRIES);
+	CHECK(counts.count(&entities.back()) && !counts.count(&entities.front()));
+}
+
+TEST(rr_dumps_trace_without_the_lock)
+{
+	RoundRobinScheduler scheduler;
+	std::vector<SchedulingEntity> entities(3);
+
+	for (SchedulingEntity& entity : entities) {
+		scheduler.add_to_runqueue(entity);
+	}
+
+	run_picks(scheduler, 30, DEFAULT_QUANTUM);
+
+	unsigned int messages = syslog.nr_messages, locked_messages = syslog.nr_locked_messages;
+	scheduler.dump_trace();
+
+	// The summary lines, then a line for each entity at least.
+	CHECK(syslog.nr_messages - messages >= 2 + entities.size());
+	CHECK(syslog.nr_locked_messages == locked_messages);
+}
+
+TEST(rr_command_line_switch_times_picks)
+{
+	// The scheduler is created before the command line is parsed, so the switch is read at the first pick.
+	RoundRobinScheduler scheduler;
+	set_cmdline_argument("sched.bench", "1");
+
+	std::vector<SchedulingEntity> entities(5);
+	for (SchedulingEntity& entity : entities) {
+		scheduler.add_to_runqueue(entity);
+	}
+
+	// Picks never log anything themselves.
+	unsigned int messages = syslog.nr_messages;
+	run_picks(scheduler, 1000, DEFAULT_QUANTUM);
+	set_cmdline_argument("sched.bench", "0");
+	CHECK(syslog.nr_messages == messages);
+
+	// Every pick was made with five runnable entities, so there is a single line of pick costs, between
+	// the summary line and the histograms.
+	messages = syslog.nr_messages;
+	CHECK(rr_dump_trace());
+	CHECK(syslog.nr_messages - messages >= 3 + entities.size());
+}
+
+TEST(mlfq_demotes_cpu_bound_entities)
+{
+	MultiLevelFeedbackQueueScheduler scheduler;
+	SchedulingEntity cpu_bound, interactive;
+
+	scheduler.add_to_runqueue(cpu_bound);
+	CHECK(scheduler.pick_next_entity() == &cpu_bound);
+
+	// Use up the top-level quantum, so the CPU-bound entity drops a level.
+	cpu_bound.charge(MLFQ_BASE_QUANTUM);
+	scheduler.add_to_runqueue(interactive);
+	CHECK(scheduler.pick_next_entity() == &interactive);
+
+	// The interactive entity blocks before using up its quantum, and keeps its level.
+	interactive.charge(MLFQ_BASE_QUANTUM / 10);
+	scheduler.remove_from_runqueue(interactive);
+	CHECK(scheduler.pick_next_entity() == &cpu_bound);
+
+	scheduler.add_to_runqueue(interactive);
+	CHECK(scheduler.pick_next_entity() == &interactive);
+}
+
+TEST(mlfq_boost_prevents_starvation)
+{
+	MultiLevelFeedbackQueueScheduler scheduler;
+	std::vector<SchedulingEntity> entities(4);
+
+	for (SchedulingEntity& entity : entities) {
+		scheduler.add_to_runqueue(entity);
+	}
+
+	std::map<SchedulingEntity *, unsigned int> counts = run_picks(scheduler, 10000, MLFQ_BASE_QUANTUM / 5);
+	CHECK(counts.size() == entities.size());
+
+	for (SchedulingEntity& entity : entities) {
+		CHECK(counts[&entity] > 1000);
+	}
+}
+
+TEST(mlfq_turns_away_entities_beyond_the_pool)
+{
+	MultiLevelFeedbackQueueScheduler scheduler;
+	std::vector<SchedulingEntity> entities(MLFQ_POOL_ENTRIES + 100);
+
+	unsigned int warnings = syslog.nr_warnings;
+	for (SchedulingEntity& entity : entities) {
+		scheduler.add_to_runqueue(entity);
+	}
+
+	CHECK(syslog.nr_warnings == warnings + 1);
+
+	std::map<SchedulingEntity *, unsigned int> counts = run_picks(scheduler, entities.size(), MLFQ_BASE_QUANTUM);
+	CHECK(counts.size() == MLFQ_POOL_ENTRIES);
+
+	// The entries of blocked entities are reused for the entities that were turned away.
+	for (unsigned int i = 0; i < 100; i++) {
+		scheduler.remove_from_runqueue(entities[i]);
+	}
+
+	for (unsigned int i = MLFQ_POOL_ENTRIES; i < entities.size(); i++) {
+		scheduler.add_to_runqueue(entities[i]);
+	}
+
+	CHECK(syslog.nr_warnings == warnings + 1);
+
+	counts = run_picks(scheduler, entities.size() * MLFQ_LEVELS, MLFQ_BASE_QUANTUM);
+	CHECK(counts.size() == MLFQ_POOL_ENTRIES);
+	CHECK(counts.count(&entities.back()) && !counts.count(&entities.front()));
+}
+
+TEST(mlfq_new_entity_at_old_address_starts_at_top)
+{
+	MultiLevelFeedbackQueueScheduler scheduler;
+	SchedulingEntity other;
+	SchedulingEntity *entity = new SchedulingEntity();
+
+	// Sink the first entity two levels, and then let it block and go away.
+	scheduler.add_to_runqueue(*entity);
+	CHECK(scheduler.pick_next_entity() == entity);
+	entity->charge(MLFQ_BASE_QUANTUM);
+	CHECK(scheduler.pick_next_entity() == entity);
+	entity->charge(MLFQ_BASE_QUANTUM * 2);
+	CHECK(scheduler.pick_next_entity() == entity);
+	scheduler.remove_from_runqueue(*entity);
+
+	// The other entity only sinks one level.
+	scheduler.add_to_runqueue(other);
+	CHECK(scheduler.pick_next_entity() == &other);
+	other.charge(MLFQ_BASE_QUANTUM);
+
+	// A new entity in the same memory starts at the top level, rather than below the other entity.
+	entity->~SchedulingEntity();
+	new (entity) SchedulingEntity();
+
+	scheduler.add_to_runqueue(*entity);
+	CHECK(scheduler.pick_next_entity() == entity);
+
+	scheduler.remove_from_runqueue(*entity);
+	delete entity;
+}
+
+int main(int argc, char **argv)
+{
+	return run_tests(argc, argv);
+}
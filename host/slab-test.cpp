@@ -0,0 +1,243 @@
+/*
+ * Host tests for the slab allocator.  slab.cpp and buddy.cpp are built unchanged against the mock
+ * kernel headers, and the caches are driven through their public interface, on top of a buddy
+ * allocator managing a mock machine.
+ */
+#include "test.h"
+#include "buddy.cpp"
+#include "slab.cpp"
+
+#include <map>
+#include <set>
+#include <string.h>
+#include <vector>
+
+/**
+ * Sets up a machine with the given number of pages, and a buddy allocator managing all of them, which
+ * the slab caches then take their pages from.  Caches must be shrunk before the allocator is deleted.
+ */
+static BuddyPageAllocator *make_allocator(uint64_t nr_pages)
+{
+	sys.mm().pgalloc().setup(nr_pages);
+
+	BuddyPageAllocator *allocator = new BuddyPageAllocator();
+	allocator->init(sys.mm().pgalloc().page_descriptors(), nr_pages);
+	return allocator;
+}
+
+struct Object {
+	uint64_t id;
+	uint8_t payload[32];
+};
+
+static unsigned int nr_constructed, nr_destroyed;
+
+static void construct_object(void *object)
+{
+	nr_constructed++;
+	((Object *)object)->id = ~0ULL;
+}
+
+static void destroy_object(void *object)
+{
+	nr_destroyed++;
+	CHECK(((Object *)object)->id == ~0ULL);
+}
+
+TEST(objects_are_aligned_and_distinct)
+{
+	BuddyPageAllocator *allocator = make_allocator(1 << 14);
+	ObjectCache<Object> cache("object");
+	std::vector<Object *> objects;
+	std::set<Object *> seen;
+
+	for (unsigned int i = 0; i < 5000; i++) {
+		Object *object = cache.alloc();
+		CHECK(object);
+		CHECK(!((uintptr_t)object & (alignof(Object) - 1)));
+		CHECK(seen.insert(object).second);
+
+		object->id = i;
+		memset(object->payload, i, sizeof(object->payload));
+		objects.push_back(object);
+	}
+
+	// Nothing was written over another object.
+	for (unsigned int i = 0; i < objects.size(); i++) {
+		CHECK(objects[i]->id == i && objects[i]->payload[31] == (uint8_t)i);
+	}
+
+	// A small object fits in a single page, without wasting more than an eighth of it.
+	CHECK(cache.slab_order() == 0);
+	CHECK(cache.objects_per_slab() * sizeof(Object) >= PAGE_BYTES * 3 / 4);
+	CHECK(cache.nr_slabs() == (objects.size() + cache.objects_per_slab() - 1) / cache.objects_per_slab());
+
+	for (Object *object : objects) {
+		cache.free(object);
+	}
+
+	// Every slab is empty now, and goes back to the page allocator.
+	unsigned int slabs = cache.nr_slabs();
+	CHECK(cache.shrink() == slabs);
+	CHECK(cache.nr_slabs() == 0);
+
+	delete allocator;
+}
+
+TEST(constructors_run_when_slabs_are_created_and_destroyed)
+{
+	BuddyPageAllocator *allocator = make_allocator(1 << 12);
+	ObjectCache<Object> cache("constructed", construct_object, destroy_object);
+	nr_constructed = nr_destroyed = 0;
+
+	// The whole slab is constructed at once.
+	Object *object = cache.alloc();
+	CHECK(object->id == ~0ULL);
+	CHECK(nr_constructed == cache.objects_per_slab());
+
+	// Objects are freed in their constructed state, and are not constructed again when reused.
+	cache.free(object);
+	CHECK(cache.alloc() == object);
+	CHECK(nr_constructed == cache.objects_per_slab());
+
+	cache.free(object);
+	CHECK(nr_destroyed == 0);
+	cache.shrink();
+	CHECK(nr_destroyed == nr_constructed);
+
+	delete allocator;
+}
+
+TEST(recently_freed_objects_are_reused_first)
+{
+	BuddyPageAllocator *allocator = make_allocator(1 << 12);
+	ObjectCache<Object> cache("hot");
+
+	Object *a = cache.alloc();
+	Object *b = cache.alloc();
+	cache.free(a);
+	cache.free(b);
+
+	CHECK(cache.alloc() == b);
+	CHECK(cache.alloc() == a);
+
+	cache.free(a);
+	cache.free(b);
+	cache.shrink();
+	delete allocator;
+}
+
+TEST(slabs_are_coloured)
+{
+	BuddyPageAllocator *allocator = make_allocator(1 << 14);
+
+	// 340-byte objects leave several cache lines spare in each page, so each slab's objects start at
+	// a different cache line from the last one's.
+	SlabCache cache("coloured", 340);
+	std::vector<void *> objects;
+	std::map<uintptr_t, uintptr_t> first_offsets;
+
+	for (unsigned int i = 0; i < cache.objects_per_slab() * 8; i++) {
+		objects.push_back(cache.alloc());
+	}
+
+	uintptr_t slab_mask = ((uintptr_t)PAGE_BYTES << cache.slab_order()) - 1;
+	for (void *object : objects) {
+		uintptr_t slab = (uintptr_t)object & ~slab_mask;
+		uintptr_t offset = (uintptr_t)object & slab_mask;
+
+		if (!first_offsets.count(slab) || offset < first_offsets[slab]) {
+			first_offsets[slab] = offset;
+		}
+	}
+
+	std::set<uintptr_t> offsets;
+	uintptr_t lowest = ~(uintptr_t)0;
+	for (auto& slab : first_offsets) {
+		offsets.insert(slab.second);
+		lowest = slab.second < lowest ? slab.second : lowest;
+	}
+
+	CHECK(first_offsets.size() == 8);
+	CHECK(offsets.size() > 1);
+	for (uintptr_t offset : offsets) {
+		CHECK((offset - lowest) % SLAB_CACHE_LINE == 0);
+	}
+
+	for (void *object : objects) {
+		cache.free(object);
+	}
+
+	cache.shrink();
+	delete allocator;
+}
+
+TEST(large_objects_use_larger_slabs)
+{
+	BuddyPageAllocator *allocator = make_allocator(1 << 12);
+
+	// Two 3000-byte objects would waste over a quarter of a page each, so they take bigger slabs.
+	SlabCache large("large", 3000);
+	CHECK(large.slab_order() > 0);
+	CHECK(large.objects_per_slab() * 3000 * 8 >= ((size_t)PAGE_BYTES << large.slab_order()) * 7);
+
+	void *object = large.alloc();
+	CHECK(object);
+	large.free(object);
+	large.shrink();
+
+	// Objects that do not fit in the largest slab are refused.
+	unsigned int warnings = mm_log.nr_warnings;
+	SlabCache oversized("oversized", PAGE_BYTES << SLAB_MAX_ORDER);
+	CHECK(mm_log.nr_warnings == warnings + 1);
+	CHECK(oversized.objects_per_slab() == 0);
+	CHECK(!oversized.alloc());
+
+	delete allocator;
+}
+
+TEST(allocation_fails_cleanly_when_memory_runs_out)
+{
+	BuddyPageAllocator *allocator = make_allocator(1 << 10);
+	ObjectCache<Object> cache("exhausted");
+	std::vector<Object *> objects;
+
+	for (;;) {
+		Object *object = cache.alloc();
+		if (!object) {
+			break;
+		}
+
+		objects.push_back(object);
+	}
+
+	CHECK(objects.size() >= cache.objects_per_slab() * 512);
+
+	for (Object *object : objects) {
+		cache.free(object);
+	}
+
+	cache.shrink();
+	CHECK(cache.nr_slabs() == 0);
+
+	// The pages all went back, so the memory can be used again.
+	Object *object = cache.alloc();
+	CHECK(object);
+	cache.free(object);
+
+	cache.shrink();
+	delete allocator;
+}
+
+TEST(no_objects_without_the_buddy_allocator)
+{
+	delete make_allocator(1 << 10);
+
+	ObjectCache<Object> cache("orphan");
+	CHECK(!cache.alloc());
+}
+
+int main(int argc, char **argv)
+{
+	return run_tests(argc, argv);
+}
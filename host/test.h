@@ -0,0 +1,108 @@
+/*
+ * A minimal test runner for the host programs.  Tests are registered with TEST(), and run in the
+ * order they are defined, or just the ones named on the command line.
+ */
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+
+struct TestCase
+{
+	const char *name;
+	void (*run)();
+	TestCase *next;
+};
+
+inline TestCase *&test_cases()
+{
+	static TestCase *head;
+	return head;
+}
+
+inline bool& test_failed()
+{
+	static bool failed;
+	return failed;
+}
+
+struct TestRegistration
+{
+	TestRegistration(TestCase *test)
+	{
+		TestCase **tail = &test_cases();
+		while (*tail) {
+			tail = &(*tail)->next;
+		}
+
+		*tail = test;
+	}
+};
+
+#define TEST(_name) \
+	static void _name(); \
+	static TestCase __test_case_##_name = { #_name, _name, NULL }; \
+	static TestRegistration __test_registration_##_name(&__test_case_##_name); \
+	static void _name()
+
+#define CHECK(_cond) \
+	do { \
+		if (!(_cond)) { \
+			printf("  %s:%d: check failed: %s\n", __FILE__, __LINE__, #_cond); \
+			test_failed() = true; \
+			return; \
+		} \
+	} while (0)
+
+inline int run_tests(int argc, char **argv)
+{
+	unsigned int nr_run = 0, nr_failed = 0;
+
+	for (TestCase *test = test_cases(); test; test = test->next) {
+		bool selected = argc < 2;
+		for (int i = 1; i < argc; i++) {
+			selected |= !strcmp(argv[i], test->name);
+		}
+
+		if (!selected) {
+			continue;
+		}
+
+		printf("%s\n", test->name);
+		fflush(stdout);
+
+		test_failed() = false;
+		test->run();
+
+		nr_run++;
+		if (test_failed()) {
+			nr_failed++;
+		}
+	}
+
+	printf("%u tests, %u failed\n", nr_run, nr_failed);
+	return nr_failed ? 1 : 0;
+}
+
+/**
+ * A small deterministic random number generator, so that every run replays the same operations.
+ */
+class TestRandom
+{
+public:
+	TestRandom(unsigned long long seed) : _state(seed ? seed : 1) { }
+
+	unsigned long long next()
+	{
+		_state ^= _state << 13;
+		_state ^= _state >> 7;
+		_state ^= _state << 17;
+		return _state;
+	}
+
+	// Returns a number in [0, bound).
+	unsigned long long below(unsigned long long bound) { return next() % bound; }
+
+private:
+	unsigned long long _state;
+};
@@ -0,0 +1,88 @@
+/*
+ * Scheduling Entity Index
+ *
+ * Shared by the schedulers, which keep their own entry for each entity they know about and need to
+ * find it again from the entity alone.
+ */
+#pragma once
+
+#include <infos/define.h>
+#include <infos/kernel/sched.h>
+
+/**
+ * A hash table that maps scheduling entities to the scheduler's entries for them.  Entries are chained
+ * through their index_next pointers, so the index never fills up however many entries there are, and
+ * lookups stay short as long as there are not many more entries than buckets.
+ *
+ * An entry type must have an "entity" field, holding the entity it belongs to, and an "index_next"
+ * field, which is owned by the index.
+ */
+template<typename Entry, unsigned int NR_BUCKETS>
+class SchedulingEntityIndex
+{
+public:
+	SchedulingEntityIndex()
+	{
+		for (unsigned int i = 0; i < NR_BUCKETS; i++) {
+			_buckets[i] = NULL;
+		}
+	}
+
+	/**
+	 * Looks up the entry for an entity.
+	 * @param entity The scheduling entity.
+	 * @return Returns the entry, or NULL if the entity is not in the index.
+	 */
+	Entry *find(const infos::kernel::SchedulingEntity *entity) const
+	{
+		for (Entry *entry = _buckets[bucket_of(entity)]; entry; entry = entry->index_next) {
+			if (entry->entity == entity) {
+				return entry;
+			}
+		}
+
+		return NULL;
+	}
+
+	/**
+	 * Adds an entry to the index.  The entity must not already be in the index.
+	 * @param entry The entry to add.
+	 */
+	void insert(Entry *entry)
+	{
+		Entry *& bucket = _buckets[bucket_of(entry->entity)];
+		entry->index_next = bucket;
+		bucket = entry;
+	}
+
+	/**
+	 * Removes an entry from the index.
+	 * @param entry The entry to remove, which must be in the index.
+	 */
+	void remove(Entry *entry)
+	{
+		Entry **link = &_buckets[bucket_of(entry->entity)];
+		while (*link != entry) {
+			link = &(*link)->index_next;
+		}
+
+		*link = entry->index_next;
+		entry->index_next = NULL;
+	}
+
+private:
+	static_assert((NR_BUCKETS & (NR_BUCKETS - 1)) == 0, "the number of buckets must be a power of two");
+
+	/**
+	 * Returns the bucket an entity hashes to.
+	 * @param entity The scheduling entity.
+	 */
+	static inline unsigned int bucket_of(const infos::kernel::SchedulingEntity *entity)
+	{
+		//entities are at least 16-byte aligned, so the low bits carry no information
+		uint64_t key = (uint64_t)entity >> 4;
+		return (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (NR_BUCKETS - 1);
+	}
+
+	Entry *_buckets[NR_BUCKETS];
+};
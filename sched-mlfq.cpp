@@ -0,0 +1,400 @@
+/*
+ * Multi-level Feedback Queue Scheduling Algorithm
+ */
+#include <infos/kernel/sched.h>
+#include <infos/kernel/thread.h>
+#include <infos/kernel/log.h>
+#include <infos/util/lock.h>
+
+#include "sched-index.h"
+
+using namespace infos::kernel;
+using namespace infos::util;
+
+#define MLFQ_LEVELS		8
+// The number of entries, and so the number of entities that can be runnable at once.
+#define MLFQ_POOL_ENTRIES	1024
+#define MLFQ_INDEX_BUCKETS	1024
+
+// The timeslice at the top level, in the units of SchedulingEntity::cpu_runtime() (nanoseconds, so 5ms).
+// Each level down doubles it.
+#define MLFQ_BASE_QUANTUM	5000000
+
+// How much CPU time may be used between priority boosts (1s).
+#define MLFQ_BOOST_PERIOD	1000000000
+
+/**
+ * A multi-level feedback queue scheduling algorithm
+ *
+ * Entities start at the highest priority level, and are moved down a level once they have used up the
+ * quantum for their level, so CPU-bound entities sink while entities that block early stay near the top.
+ * The highest non-empty level is found with a bitmap, and entities within a level are run round-robin.
+ * Every MLFQ_BOOST_PERIOD of CPU time all entities are moved back to the top level, so nothing starves.
+ *
+ * An entity keeps its entry (and so its level) while it is blocked.  Entries are taken from a pool and
+ * found through a hashed index; when the pool runs out, the entry of the entity that has been blocked the
+ * longest is reused.  Nothing is allocated on the scheduling path, so if every entry belongs to a runnable
+ * entity, a new entity is turned away with a warning until there is room.  The scheduler is not told when an entity is destroyed, so an entry whose entity has
+ * used less CPU time than when it was last charged belongs to a new entity at the same address, and is
+ * reset when that entity is added.
+ */
+class MultiLevelFeedbackQueueScheduler : public SchedulingAlgorithm
+{
+public:
+	MultiLevelFeedbackQueueScheduler() : _running(NULL), _free_entries(NULL), _nr_turned_away(0), _nonempty_levels(0), _epoch(0),
+		_since_boost(0)
+	{
+		for (unsigned int i = 0; i < MLFQ_POOL_ENTRIES; i++) {
+			_entries[i].entity = NULL;
+			_entries[i].next = _free_entries;
+			_entries[i].prev = NULL;
+			_free_entries = &_entries[i];
+		}
+
+		for (unsigned int i = 0; i < MLFQ_LEVELS; i++) {
+			_levels[i].head = NULL;
+			_levels[i].tail = NULL;
+		}
+
+		_blocked.head = NULL;
+		_blocked.tail = NULL;
+	}
+
+	/**
+	 * Returns the friendly name of the algorithm, for debugging and selection purposes.
+	 */
+	const char* name() const override { return "mlfq"; }
+
+	/**
+	 * Called when a scheduling entity becomes eligible for running.
+	 * @param entity
+	 */
+	void add_to_runqueue(SchedulingEntity& entity) override
+	{
+		UniqueIRQLock l;
+
+		MLFQEntry *entry = _index.find(&entity);
+		if (entry) {
+			if (entry->runnable) {
+				return;
+			}
+
+			queue_unlink(_blocked, entry);
+			refresh_entry(entry);
+
+			//an entity's CPU time never goes backwards, so this is a new entity at the old one's address
+			if (entity.cpu_runtime() < entry->slice_start) {
+				reset_entry(entry);
+			}
+		} else {
+			//the first entity turned away since there was last room is reported
+			entry = alloc_entry();
+			if (!entry) {
+				if (!_nr_turned_away++) {
+					syslog.messagef(LogLevel::WARNING, "MLFQ: every entry belongs to a runnable entity");
+				}
+
+				return;
+			}
+
+			entry->entity = &entity;
+			reset_entry(entry);
+			_index.insert(entry);
+		}
+
+		entry->runnable = true;
+		enqueue_entry(entry);
+	}
+
+	/**
+	 * Called when a scheduling entity is no longer eligible for running.
+	 * @param entity
+	 */
+	void remove_from_runqueue(SchedulingEntity& entity) override
+	{
+		UniqueIRQLock l;
+
+		MLFQEntry *entry = _index.find(&entity);
+		if (!entry || !entry->runnable) {
+			return;
+		}
+
+		//charge the time it ran for before blocking, so that it can't dodge demotion by blocking
+		if (_running == entry) {
+			charge_entry(entry);
+			_running = NULL;
+		}
+
+		refresh_entry(entry);
+		dequeue_entry(entry);
+
+		entry->runnable = false;
+		queue_push(_blocked, entry);
+		_nr_turned_away = 0;
+	}
+
+	/**
+	 * Called every time a scheduling event occurs, to cause the next eligible entity
+	 * to be chosen.  The running entity keeps running until it uses up its quantum,
+	 * blocks, or an entity with a higher priority becomes runnable.
+	 */
+	SchedulingEntity *pick_next_entity() override
+	{
+		UniqueIRQLock l;
+
+		if (_running) {
+			charge_entry(_running);
+		}
+
+		if (_since_boost >= MLFQ_BOOST_PERIOD) {
+			boost();
+		}
+
+		if (!_nonempty_levels) {
+			_running = NULL;
+			return NULL;
+		}
+
+		//the running entity stays at the head of its level until its quantum runs out, so picking
+		//the head of the highest level either keeps it running or preempts it
+		MLFQEntry *entry = _levels[__builtin_ctz(_nonempty_levels)].head;
+		if (entry != _running) {
+			entry->slice_start = entry->entity->cpu_runtime();
+			_running = entry;
+		}
+
+		return entry->entity;
+	}
+
+private:
+	struct MLFQEntry {
+		SchedulingEntity *entity;
+
+		// The priority level, and the CPU time used at that level.  Only valid if the epoch matches the
+		// scheduler's, otherwise there has been a boost since and the entity is at the top level.
+		unsigned int level;
+		SchedulingEntity::EntityRuntime used;
+		unsigned int epoch;
+
+		// The entity's CPU runtime when it was last charged.
+		SchedulingEntity::EntityRuntime slice_start;
+		bool runnable;
+
+		MLFQEntry *next;
+		MLFQEntry *prev;
+		MLFQEntry *index_next;
+	};
+
+	struct MLFQQueue {
+		MLFQEntry *head;
+		MLFQEntry *tail;
+	};
+
+	/**
+	 * Returns the quantum for a priority level.
+	 * @param level The priority level.
+	 */
+	static inline SchedulingEntity::EntityRuntime level_quantum(unsigned int level)
+	{
+		return (SchedulingEntity::EntityRuntime)MLFQ_BASE_QUANTUM << level;
+	}
+
+	/**
+	 * Appends an entry to the tail of a queue.
+	 * @param queue The queue.
+	 * @param entry The entry to append.
+	 */
+	static void queue_push(MLFQQueue& queue, MLFQEntry *entry)
+	{
+		entry->next = NULL;
+		entry->prev = queue.tail;
+
+		if (queue.tail) {
+			queue.tail->next = entry;
+		} else {
+			queue.head = entry;
+		}
+
+		queue.tail = entry;
+	}
+
+	/**
+	 * Unlinks an entry from a queue.
+	 * @param queue The queue the entry is on.
+	 * @param entry The entry to unlink.
+	 */
+	static void queue_unlink(MLFQQueue& queue, MLFQEntry *entry)
+	{
+		if (entry->prev) {
+			entry->prev->next = entry->next;
+		} else {
+			queue.head = entry->next;
+		}
+
+		if (entry->next) {
+			entry->next->prev = entry->prev;
+		} else {
+			queue.tail = entry->prev;
+		}
+
+		entry->next = NULL;
+		entry->prev = NULL;
+	}
+
+	/**
+	 * Resets an entry to the top level if there has been a priority boost since it was last looked at.
+	 * @param entry The entry to refresh.
+	 */
+	inline void refresh_entry(MLFQEntry *entry)
+	{
+		if (entry->epoch != _epoch) {
+			entry->level = 0;
+			entry->used = 0;
+			entry->epoch = _epoch;
+		}
+	}
+
+	/**
+	 * Starts an entry off afresh at the top level, for an entity the scheduler has not seen before.
+	 * @param entry The entry to reset, which already belongs to the entity.
+	 */
+	inline void reset_entry(MLFQEntry *entry)
+	{
+		entry->level = 0;
+		entry->used = 0;
+		entry->epoch = _epoch;
+		entry->slice_start = entry->entity->cpu_runtime();
+	}
+
+	/**
+	 * Puts an entry on the tail of the queue for its level.
+	 * @param entry The entry to enqueue.
+	 */
+	void enqueue_entry(MLFQEntry *entry)
+	{
+		queue_push(_levels[entry->level], entry);
+		_nonempty_levels |= 1u << entry->level;
+	}
+
+	/**
+	 * Takes an entry off the queue for its level.
+	 * @param entry The entry to dequeue.
+	 */
+	void dequeue_entry(MLFQEntry *entry)
+	{
+		queue_unlink(_levels[entry->level], entry);
+		if (!_levels[entry->level].head) {
+			_nonempty_levels &= ~(1u << entry->level);
+		}
+	}
+
+	/**
+	 * Charges an entry for the CPU time it has used since it was last charged.  If it has used up the
+	 * quantum for its level it is moved down a level (or to the back of the bottom level).
+	 * @param entry The entry of the running entity.
+	 */
+	void charge_entry(MLFQEntry *entry)
+	{
+		SchedulingEntity::EntityRuntime now = entry->entity->cpu_runtime();
+		SchedulingEntity::EntityRuntime delta = now - entry->slice_start;
+
+		entry->slice_start = now;
+		_since_boost += delta;
+
+		refresh_entry(entry);
+		entry->used += delta;
+
+		if (entry->used < level_quantum(entry->level)) {
+			return;
+		}
+
+		dequeue_entry(entry);
+		if (entry->level < MLFQ_LEVELS - 1) {
+			entry->level++;
+		}
+
+		entry->used = 0;
+		enqueue_entry(entry);
+	}
+
+	/**
+	 * Moves every entity back to the top level.  The lower levels are appended to the top level in
+	 * priority order, and the epoch is advanced so that each entry's level is reset when it is next used.
+	 */
+	void boost()
+	{
+		for (unsigned int level = 1; level < MLFQ_LEVELS; level++) {
+			MLFQQueue& queue = _levels[level];
+			if (!queue.head) {
+				continue;
+			}
+
+			if (_levels[0].tail) {
+				_levels[0].tail->next = queue.head;
+				queue.head->prev = _levels[0].tail;
+			} else {
+				_levels[0].head = queue.head;
+			}
+
+			_levels[0].tail = queue.tail;
+			queue.head = NULL;
+			queue.tail = NULL;
+		}
+
+		_nonempty_levels = _levels[0].head ? 1 : 0;
+		_epoch++;
+		_since_boost = 0;
+	}
+
+	/**
+	 * Takes an entry from the pool, reusing the entry of the longest-blocked entity if the pool is empty.
+	 * @return Returns the entry, which belongs to no entity, or NULL if every entry belongs to a runnable
+	 * entity.
+	 */
+	MLFQEntry *alloc_entry()
+	{
+		MLFQEntry *entry = _free_entries;
+		if (entry) {
+			_free_entries = entry->next;
+			return entry;
+		}
+
+		entry = _blocked.head;
+		if (!entry) {
+			return NULL;
+		}
+
+		queue_unlink(_blocked, entry);
+		_index.remove(entry);
+		return entry;
+	}
+
+	// The entry of the entity that was picked last, or NULL if it has since blocked.
+	MLFQEntry *_running;
+
+	// Entries that belong to no entity, linked through their next pointers.
+	MLFQEntry *_free_entries;
+
+	// The number of entities turned away since an entity last blocked.
+	unsigned int _nr_turned_away;
+
+	// The runnable entities at each level, and a bitmap of the levels that are not empty.
+	MLFQQueue _levels[MLFQ_LEVELS];
+	uint32_t _nonempty_levels;
+
+	// Blocked entities that still have an entry, oldest first.
+	MLFQQueue _blocked;
+
+	// Advanced on every priority boost.
+	unsigned int _epoch;
+
+	// The CPU time charged since the last priority boost.
+	SchedulingEntity::EntityRuntime _since_boost;
+
+	MLFQEntry _entries[MLFQ_POOL_ENTRIES];
+	SchedulingEntityIndex<MLFQEntry, MLFQ_INDEX_BUCKETS> _index;
+};
+
+/* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
+
+RegisterScheduler(MultiLevelFeedbackQueueScheduler);
@@ -9,23 +9,122 @@
 #include <infos/kernel/sched.h>
 #include <infos/kernel/thread.h>
 #include <infos/kernel/log.h>
-#include <infos/util/list.h>
+#include <infos/kernel/cmdline.h>
 #include <infos/util/lock.h>
 
+#include "cycle-counter.h"
+#include "sched-index.h"
+#include "sched-rr.h"
+
 using namespace infos::kernel;
 using namespace infos::util;
 
+// The number of runqueue entries, and so the number of entities that can be runnable at once.
+#define RUNQUEUE_POOL_ENTRIES	1024
+#define RUNQUEUE_INDEX_BUCKETS	1024
+
+// The default timeslice, in the units of SchedulingEntity::cpu_runtime() (nanoseconds, so 10ms).
+#define DEFAULT_QUANTUM	10000000
+
+// The number of events kept in the trace ring.  Must be a power of two.
+#define TRACE_EVENTS		4096
+
+// Pick costs are kept separately for each power-of-two number of runnable entities, up to 2^(PICK_BUCKETS - 2).
+#define PICK_BUCKETS		16
+
+namespace TraceEventType {
+	enum TraceEventType {
+		ENQUEUE,
+		DEQUEUE,
+		SWITCH_IN,
+		SWITCH_OUT,
+	};
+}
+
+// Set by "sched.bench=1" on the kernel command line, to time each pick.
+static bool sched_benchmark_requested;
+
+RegisterCmdLineArgument(SchedulerBenchmark, "sched.bench")
+{
+	sched_benchmark_requested = value[0] && value[0] != '0';
+}
+
 /**
  * A round-robin scheduling algorithm
+ *
+ * The runqueue is a circular list of entries taken from a pool owned by the scheduler, with a cursor
+ * pointing at the entity that will run next.  Scheduling entities are mapped to their entries through a
+ * hashed index, so enqueue, dequeue and pick are all O(1).  Nothing is allocated on the scheduling path,
+ * so at most RUNQUEUE_POOL_ENTRIES entities can be runnable at once.  Any more are turned away with a
+ * warning, and stay off the runqueue until they are added again once there is room.
+ *
+ * The entity that was picked last keeps running until it has used up a full quantum of CPU time or leaves
+ * the runqueue, rather than being switched out on every scheduling event.
+ *
+ * Every enqueue, dequeue and switch is recorded in a trace ring, and the time entities spend waiting on the
+ * runqueue and running is kept in histograms.  With "sched.bench=1" on the kernel command line, the cycles
+ * spent choosing the next entity are also counted against the number of entities that were runnable at
+ * the time.  That is only the scheduler's own bookkeeping, not the cost of a context switch.  Everything
+ * is logged on demand by rr_dump_trace().
  */
 class RoundRobinScheduler : public SchedulingAlgorithm
 {
 public:
+	RoundRobinScheduler() : _cursor(NULL), _running(NULL), _quantum(DEFAULT_QUANTUM), _free_entries(NULL), _nr_runnable(0),
+		_nr_turned_away(0), _trace_head(0), _nr_switches(0), _timing_checked(false), _timing_picks(false)
+	{
+		for (unsigned int i = 0; i < RUNQUEUE_POOL_ENTRIES; i++) {
+			_entries[i].entity = NULL;
+			_entries[i].next = _free_entries;
+			_entries[i].prev = NULL;
+			_free_entries = &_entries[i];
+		}
+
+		for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+			_wait_time[i] = 0;
+			_run_time[i] = 0;
+		}
+
+		for (unsigned int i = 0; i < PICK_BUCKETS; i++) {
+			_nr_picks[i] = 0;
+			_pick_cycles[i] = 0;
+		}
+
+		rr_scheduler = this;
+	}
+
+	~RoundRobinScheduler()
+	{
+		if (rr_scheduler == this) {
+			rr_scheduler = NULL;
+		}
+	}
+
+	/**
+	 * A scheduling event recorded in the trace ring.
+	 */
+	struct TraceEvent {
+		uint64_t timestamp;
+		SchedulingEntity *entity;
+		TraceEventType::TraceEventType type;
+	};
+
 	/**
 	 * Returns the friendly name of the algorithm, for debugging and selection purposes.
 	 */
 	const char* name() const override { return "rr"; }
 
+	/**
+	 * Sets the amount of CPU time an entity may use before the next entity is picked.
+	 * @param quantum The timeslice, in the units of SchedulingEntity::cpu_runtime().  Zero switches to the
+	 * next entity on every scheduling event.
+	 */
+	void set_quantum(SchedulingEntity::EntityRuntime quantum)
+	{
+		UniqueIRQLock l;
+		_quantum = quantum;
+	}
+
 	/**
 	 * Called when a scheduling entity becomes eligible for running.
 	 * @param entity
@@ -33,7 +132,42 @@ public:
 	void add_to_runqueue(SchedulingEntity& entity) override
 	{
 		UniqueIRQLock l;
-		runqueue.enqueue(&entity);
+
+		if (_index.find(&entity)) {
+			return;
+		}
+
+		//nothing can be allocated here, so once the pool is used up the entity is turned away, and
+		//the first one turned away since there was last room is reported
+		RunqueueEntry *entry = _free_entries;
+		if (!entry) {
+			if (!_nr_turned_away++) {
+				syslog.messagef(LogLevel::WARNING, "RR: runqueue is full, with %u runnable entities", _nr_runnable);
+			}
+
+			return;
+		}
+
+		_free_entries = entry->next;
+
+		entry->entity = &entity;
+		entry->wait_start = read_cycle_counter();
+		_index.insert(entry);
+		trace_event(TraceEventType::ENQUEUE, &entity, entry->wait_start);
+
+		//new entities go to the back of the queue, which is just behind the cursor
+		if (!_cursor) {
+			entry->next = entry;
+			entry->prev = entry;
+			_cursor = entry;
+		} else {
+			entry->next = _cursor;
+			entry->prev = _cursor->prev;
+			_cursor->prev->next = entry;
+			_cursor->prev = entry;
+		}
+
+		_nr_runnable++;
 	}
 
 	/**
@@ -43,7 +177,39 @@ public:
 	void remove_from_runqueue(SchedulingEntity& entity) override
 	{
 		UniqueIRQLock l;
-		runqueue.remove(&entity);
+
+		RunqueueEntry *entry = _index.find(&entity);
+		if (!entry) {
+			return;
+		}
+
+		uint64_t now = read_cycle_counter();
+		if (_running == entry) {
+			record_latency(_run_time, now - entry->run_start);
+			_running = NULL;
+		}
+
+		trace_event(TraceEventType::DEQUEUE, &entity, now);
+
+		if (entry->next == entry) {
+			_cursor = NULL;
+		} else {
+			if (_cursor == entry) {
+				_cursor = entry->next;
+			}
+
+			entry->prev->next = entry->next;
+			entry->next->prev = entry->prev;
+		}
+
+		_index.remove(entry);
+		entry->entity = NULL;
+		entry->prev = NULL;
+		entry->next = _free_entries;
+		_free_entries = entry;
+
+		_nr_runnable--;
+		_nr_turned_away = 0;
 	}
 
 	/**
@@ -53,23 +219,349 @@ public:
 	 */
 	SchedulingEntity *pick_next_entity() override
 	{
-		if (runqueue.empty()) return NULL;
-		SchedulingEntity* first_entity = runqueue.first();
-		
-		//Done like this because the IRQlock is only needed when actually 
-		//	    manipulating the runqueue, not in the rest of it
-		remove_from_runqueue(*first_entity);
-		add_to_runqueue(*first_entity);
-		return first_entity;
-
-		
+		UniqueIRQLock l;
+
+		//the scheduler can be created before the command line is parsed, so the switch is read here
+		if (!_timing_checked) {
+			_timing_checked = true;
+			_timing_picks = sched_benchmark_requested;
+		}
+
+		if (!_timing_picks) {
+			return choose_next_entity();
+		}
+
+		unsigned int bucket = pick_bucket(_nr_runnable);
+		uint64_t start = read_cycle_counter();
+		SchedulingEntity *entity = choose_next_entity();
+
+		_pick_cycles[bucket] += read_cycle_counter() - start;
+		_nr_picks[bucket]++;
+		return entity;
+	}
+
+	/**
+	 * Copies the most recent events out of the trace ring, oldest first.
+	 * @param events The array to copy the events into.
+	 * @param count The maximum number of events to copy.
+	 * @return Returns the number of events copied.
+	 */
+	unsigned int read_trace(TraceEvent *events, unsigned int count) const
+	{
+		UniqueIRQLock l;
+		return read_trace_locked(events, count);
 	}
 
+	/**
+	 * Prints the runqueue wait-time and run-time histograms, followed by the same histograms for each
+	 * entity in the trace ring, worked out from its events.  The counters and the ring are copied out
+	 * with the lock held, and everything else is done after it has been dropped, so scheduling is only
+	 * held up for as long as the copy takes.  If picks are being timed, the average cost of a pick is
+	 * logged for each number of runnable entities that picks were made with.  This logs a lot, so it
+	 * must not be called from the scheduling path.
+	 * @return Returns true if the trace was dumped, or false if another dump is using the copy.
+	 */
+	bool dump_trace() const
+	{
+		//the copy is too big for the stack, so there is one, and only one dump can use it at a time
+		if (__atomic_exchange_n(&dump_in_progress, true, __ATOMIC_ACQUIRE)) {
+			return false;
+		}
+
+		TraceEvent *events = dump_events;
+		uint64_t wait_time[LATENCY_BUCKETS], run_time[LATENCY_BUCKETS];
+		uint64_t nr_picks[PICK_BUCKETS], pick_cycles[PICK_BUCKETS];
+		uint64_t nr_switches, trace_head;
+		unsigned int nr_runnable, count;
+
+		{
+			UniqueIRQLock l;
+
+			nr_runnable = _nr_runnable;
+			nr_switches = _nr_switches;
+			trace_head = _trace_head;
+
+			for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+				wait_time[i] = _wait_time[i];
+				run_time[i] = _run_time[i];
+			}
+
+			for (unsigned int i = 0; i < PICK_BUCKETS; i++) {
+				nr_picks[i] = _nr_picks[i];
+				pick_cycles[i] = _pick_cycles[i];
+			}
+
+			count = read_trace_locked(events, TRACE_EVENTS);
+		}
+
+		syslog.messagef(LogLevel::DEBUG, "RR: runnable=%u switches=%lu events=%lu",
+			nr_runnable, nr_switches, trace_head);
+
+		for (unsigned int i = 0; i < PICK_BUCKETS; i++) {
+			if (!nr_picks[i]) {
+				continue;
+			}
+
+			//bucket 0 is an empty runqueue, and bucket N covers 2^(N-1) up to 2^N - 1 runnable entities
+			syslog.messagef(LogLevel::INFO, "rr pick_cost runnable_min=%u runnable_max=%u picks=%lu avg_cycles=%lu",
+				i ? 1u << (i - 1) : 0, i ? (1u << i) - 1 : 0, nr_picks[i], pick_cycles[i] / nr_picks[i]);
+		}
+
+		dump_histograms(NULL, wait_time, run_time);
+
+		//each entity is dumped once, at its first event, and its events are then cleared out of the copy
+		for (unsigned int i = 0; i < count; i++) {
+			SchedulingEntity *entity = events[i].entity;
+			if (!entity) {
+				continue;
+			}
+
+			trace_histograms(&events[i], count - i, entity, wait_time, run_time);
+			dump_histograms(entity, wait_time, run_time);
+		}
+
+		__atomic_store_n(&dump_in_progress, false, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	// The scheduler that rr_dump_trace() dumps, which is the one created last.
+	static RoundRobinScheduler *rr_scheduler;
+
 private:
-	// A list containing the current runqueue.
-	List<SchedulingEntity *> runqueue;
+	struct RunqueueEntry {
+		SchedulingEntity *entity;
+		SchedulingEntity::EntityRuntime slice_start;
+
+		// When the entity last started waiting on the runqueue, and last started running, in cycles.
+		uint64_t wait_start;
+		uint64_t run_start;
+
+		RunqueueEntry *next;
+		RunqueueEntry *prev;
+		RunqueueEntry *index_next;
+	};
+
+	/**
+	 * Returns the pick cost bucket for a number of runnable entities.  The last bucket also counts
+	 * anything larger.
+	 * @param nr_runnable The number of runnable entities.
+	 */
+	static inline unsigned int pick_bucket(unsigned int nr_runnable)
+	{
+		unsigned int bucket = nr_runnable ? 32 - __builtin_clz(nr_runnable) : 0;
+		return bucket < PICK_BUCKETS ? bucket : PICK_BUCKETS - 1;
+	}
+
+	/**
+	 * Chooses the entity to run next, rotating the runqueue once the current entity's timeslice has
+	 * expired.  Must be called with the lock held.
+	 */
+	SchedulingEntity *choose_next_entity()
+	{
+		//keep running the current entity until its timeslice has been used up
+		if (_running && _running->entity->cpu_runtime() - _running->slice_start < _quantum) {
+			return _running->entity;
+		}
+
+		if (!_cursor) {
+			_running = NULL;
+			return NULL;
+		}
+
+		//rotating the queue is just moving the cursor on by one
+		RunqueueEntry *entry = _cursor;
+		_cursor = entry->next;
+
+		if (entry != _running) {
+			uint64_t now = read_cycle_counter();
+
+			//the previous entity is still runnable, so it starts waiting again
+			if (_running) {
+				record_latency(_run_time, now - _running->run_start);
+				_running->wait_start = now;
+				trace_event(TraceEventType::SWITCH_OUT, _running->entity, now);
+			}
+
+			record_latency(_wait_time, now - entry->wait_start);
+			entry->run_start = now;
+			trace_event(TraceEventType::SWITCH_IN, entry->entity, now);
+			_nr_switches++;
+		}
+
+		entry->slice_start = entry->entity->cpu_runtime();
+		_running = entry;
+		return entry->entity;
+	}
+
+	/**
+	 * Copies the most recent events out of the trace ring, oldest first.  Must be called with the lock held.
+	 * @param events The array to copy the events into.
+	 * @param count The maximum number of events to copy.
+	 * @return Returns the number of events copied.
+	 */
+	unsigned int read_trace_locked(TraceEvent *events, unsigned int count) const
+	{
+		uint64_t available = _trace_head < TRACE_EVENTS ? _trace_head : TRACE_EVENTS;
+		if (count > available) {
+			count = available;
+		}
+
+		uint64_t first = _trace_head - count;
+		for (unsigned int i = 0; i < count; i++) {
+			events[i] = _trace[(first + i) & (TRACE_EVENTS - 1)];
+		}
+
+		return count;
+	}
+
+	/**
+	 * Appends an event to the trace ring, overwriting the oldest event once the ring is full.
+	 * @param type The type of event.
+	 * @param entity The entity the event happened to.
+	 * @param timestamp When the event happened, in cycles.
+	 */
+	inline void trace_event(TraceEventType::TraceEventType type, SchedulingEntity *entity, uint64_t timestamp)
+	{
+		TraceEvent& event = _trace[_trace_head & (TRACE_EVENTS - 1)];
+		event.timestamp = timestamp;
+		event.entity = entity;
+		event.type = type;
+
+		_trace_head++;
+	}
+
+	/**
+	 * Works out the wait-time and run-time histograms of one entity from a copy of the trace ring, and
+	 * clears the entity's events out of the copy.  Periods that started before the oldest event in the
+	 * copy are not counted.
+	 * @param events The events, oldest first.
+	 * @param count The number of events.
+	 * @param entity The entity to look for.
+	 * @param wait_time The histogram to fill in with the time spent waiting on the runqueue.
+	 * @param run_time The histogram to fill in with the time spent running.
+	 */
+	static void trace_histograms(TraceEvent *events, unsigned int count, const SchedulingEntity *entity,
+		uint64_t *wait_time, uint64_t *run_time)
+	{
+		for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+			wait_time[i] = 0;
+			run_time[i] = 0;
+		}
+
+		uint64_t wait_start = 0, run_start = 0;
+
+		for (unsigned int i = 0; i < count; i++) {
+			TraceEvent& event = events[i];
+			if (event.entity != entity) {
+				continue;
+			}
+
+			event.entity = NULL;
+
+			switch (event.type) {
+			case TraceEventType::ENQUEUE:
+				wait_start = event.timestamp;
+				break;
+
+			case TraceEventType::DEQUEUE:
+				if (run_start) {
+					record_latency(run_time, event.timestamp - run_start);
+				}
+
+				wait_start = 0;
+				run_start = 0;
+				break;
+
+			case TraceEventType::SWITCH_IN:
+				if (wait_start) {
+					record_latency(wait_time, event.timestamp - wait_start);
+				}
+
+				wait_start = 0;
+				run_start = event.timestamp;
+				break;
+
+			case TraceEventType::SWITCH_OUT:
+				if (run_start) {
+					record_latency(run_time, event.timestamp - run_start);
+				}
+
+				wait_start = event.timestamp;
+				run_start = 0;
+				break;
+			}
+		}
+	}
+
+	/**
+	 * Prints the non-empty buckets of a pair of wait-time and run-time histograms.
+	 * @param entity The entity the histograms belong to, or NULL for the whole runqueue.
+	 * @param wait_time The wait-time histogram.
+	 * @param run_time The run-time histogram.
+	 */
+	static void dump_histograms(const SchedulingEntity *entity, const uint64_t *wait_time, const uint64_t *run_time)
+	{
+		if (entity) {
+			syslog.messagef(LogLevel::DEBUG, "RR ENTITY %p:", entity);
+		}
+
+		for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+			if (wait_time[i] || run_time[i]) {
+				syslog.messagef(LogLevel::DEBUG, "  <%lu cycles: wait=%lu run=%lu",
+					(uint64_t)2 << i, wait_time[i], run_time[i]);
+			}
+		}
+	}
+
+	// The entry of the entity that will be picked next, or NULL if the runqueue is empty.
+	RunqueueEntry *_cursor;
+
+	// The entry of the entity that was picked last, and is still within its timeslice.
+	RunqueueEntry *_running;
+	SchedulingEntity::EntityRuntime _quantum;
+
+	// Entries that are not currently on the runqueue, linked through their next pointers.
+	RunqueueEntry *_free_entries;
+	unsigned int _nr_runnable;
+
+	// The number of entities turned away since an entry was last freed.
+	unsigned int _nr_turned_away;
+
+	// The trace ring, and the total number of events ever written to it.
+	TraceEvent _trace[TRACE_EVENTS];
+	uint64_t _trace_head;
+
+	uint64_t _nr_switches;
+
+	// The number of picks, and the cycles spent in them, for each pick_bucket() of runnable entities.
+	uint64_t _nr_picks[PICK_BUCKETS];
+	uint64_t _pick_cycles[PICK_BUCKETS];
+
+	// Whether the command line has been checked yet, and whether it asked for picks to be timed.
+	bool _timing_checked;
+	bool _timing_picks;
+
+	uint64_t _wait_time[LATENCY_BUCKETS];
+	uint64_t _run_time[LATENCY_BUCKETS];
+
+	RunqueueEntry _entries[RUNQUEUE_POOL_ENTRIES];
+	SchedulingEntityIndex<RunqueueEntry, RUNQUEUE_INDEX_BUCKETS> _index;
+
+	// The copy of the trace ring that dump_trace() works from, and whether a dump is using it.
+	static TraceEvent dump_events[TRACE_EVENTS];
+	static bool dump_in_progress;
 };
 
+RoundRobinScheduler *RoundRobinScheduler::rr_scheduler;
+RoundRobinScheduler::TraceEvent RoundRobinScheduler::dump_events[TRACE_EVENTS];
+bool RoundRobinScheduler::dump_in_progress;
+
+bool rr_dump_trace()
+{
+	RoundRobinScheduler *scheduler = RoundRobinScheduler::rr_scheduler;
+	return scheduler && scheduler->dump_trace();
+}
+
 /* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
 
 RegisterScheduler(RoundRobinScheduler);
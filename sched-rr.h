@@ -0,0 +1,15 @@
+/*
+ * Round-robin Scheduler Trace
+ *
+ * Lets the kernel dump the round-robin scheduler's trace and pick costs on demand, for example from a
+ * shell command, rather than from the scheduling path.
+ */
+#pragma once
+
+/**
+ * Logs the round-robin scheduler's trace, histograms and pick costs.  Logging is slow, so this must
+ * be called from thread context, never from the scheduling path or with interrupts disabled.
+ * @return Returns true if the trace was dumped, or false if the round-robin scheduler has not been
+ * created or another dump is in progress.
+ */
+bool rr_dump_trace();
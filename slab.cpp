@@ -0,0 +1,354 @@
+/*
+ * Slab Allocator
+ */
+#include "slab.h"
+
+#include <infos/mm/mm.h>
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/log.h>
+#include <infos/util/lock.h>
+
+using namespace infos::kernel;
+using namespace infos::mm;
+using namespace infos::util;
+
+// The size of a page, in bytes.
+#define PAGE_BYTES	0x1000
+
+/**
+ * The header at the start of each slab.  It is followed by a stack of the indices of the slab's free
+ * objects, and then by the objects themselves, shifted along by the slab's colour.
+ */
+struct SlabCache::Slab {
+	PageDescriptor *pages;
+	Slab *next;
+	Slab *prev;
+
+	// The list the slab is on.
+	Slab **list;
+
+	uint8_t *objects;
+	unsigned int nr_free;
+
+	uint16_t *free_indices() { return (uint16_t *)(this + 1); }
+};
+
+static inline size_t align_up(size_t value, size_t align)
+{
+	return (value + align - 1) & ~(align - 1);
+}
+
+/**
+ * Returns how many objects fit in a slab of the given size, and where the first one starts.
+ */
+static unsigned int fit_objects(size_t slab_bytes, size_t header_bytes, size_t object_size, size_t align, size_t *offset)
+{
+	size_t nr = (slab_bytes - header_bytes) / (object_size + sizeof(uint16_t));
+	if (nr > 0xffff) {
+		nr = 0xffff;
+	}
+
+	// The index stack may push the first object past an alignment boundary, so fewer may fit.
+	while (nr && align_up(header_bytes + nr * sizeof(uint16_t), align) + nr * object_size > slab_bytes) {
+		nr--;
+	}
+
+	*offset = align_up(header_bytes + nr * sizeof(uint16_t), align);
+	return nr;
+}
+
+SlabCache::SlabCache(const char *name, size_t object_size, size_t align, void (*ctor)(void *), void (*dtor)(void *),
+	MigrateType::MigrateType type)
+	: _name(name), _align(align), _ctor(ctor), _dtor(dtor), _type(type), _next_colour(0),
+	_partial(NULL), _empty(NULL), _full(NULL), _nr_slabs(0), _nr_empty(0), _magazine_count(0)
+{
+	assert(align && !(align & (align - 1)));
+	_object_size = align_up(object_size ? object_size : 1, align);
+
+	// Use the smallest slab that wastes no more than an eighth of itself, or the largest slab if none do.
+	size_t waste = 0;
+	for (_slab_order = 0; _slab_order <= SLAB_MAX_ORDER; _slab_order++) {
+		size_t slab_bytes = (size_t)PAGE_BYTES << _slab_order;
+
+		_objects_per_slab = fit_objects(slab_bytes, sizeof(Slab), _object_size, align, &_objects_offset);
+		waste = slab_bytes - _objects_offset - _objects_per_slab * _object_size;
+
+		if (_objects_per_slab && waste * 8 <= slab_bytes) {
+			break;
+		}
+	}
+
+	if (_slab_order > SLAB_MAX_ORDER) {
+		_slab_order = SLAB_MAX_ORDER;
+	}
+
+	// The space left over is used to start each slab's objects at a different cache line.
+	_nr_colours = waste / (align > SLAB_CACHE_LINE ? align : SLAB_CACHE_LINE) + 1;
+
+	if (!_objects_per_slab) {
+		mm_log.messagef(LogLevel::WARNING, "slab: objects of %lu bytes are too large for cache %s", (uint64_t)object_size, name);
+	}
+}
+
+SlabCache::~SlabCache()
+{
+	shrink();
+
+	if (_nr_slabs) {
+		mm_log.messagef(LogLevel::WARNING, "slab: cache %s destroyed with %u slabs in use", _name, _nr_slabs);
+	}
+}
+
+void *SlabCache::alloc()
+{
+	{
+		UniqueIRQLock l;
+
+		if (_magazine_count || refill_magazine()) {
+			return _magazine[--_magazine_count];
+		}
+	}
+
+	if (!_objects_per_slab) {
+		return NULL;
+	}
+
+	// The pages are taken and the objects constructed without the lock held.
+	Slab *slab = create_slab();
+	if (!slab) {
+		return NULL;
+	}
+
+	UniqueIRQLock l;
+
+	_nr_slabs++;
+	move_slab(slab, &_empty);
+
+	refill_magazine();
+	return _magazine[--_magazine_count];
+}
+
+void SlabCache::free(void *object)
+{
+	Slab *release;
+
+	{
+		UniqueIRQLock l;
+
+		// Once the magazine is full, the objects that have been in it longest go back to their slabs.
+		if (_magazine_count == SLAB_MAGAZINE_SIZE) {
+			flush_magazine(SLAB_MAGAZINE_BATCH);
+		}
+
+		_magazine[_magazine_count++] = object;
+		release = take_empty_slabs(SLAB_EMPTY_HIGH);
+	}
+
+	while (release) {
+		Slab *next = release->next;
+		destroy_slab(release);
+		release = next;
+	}
+}
+
+unsigned int SlabCache::shrink()
+{
+	Slab *release;
+
+	{
+		UniqueIRQLock l;
+
+		flush_magazine(_magazine_count);
+		release = take_empty_slabs(0);
+	}
+
+	unsigned int pages = 0;
+	while (release) {
+		Slab *next = release->next;
+		destroy_slab(release);
+		pages += 1 << _slab_order;
+		release = next;
+	}
+
+	return pages;
+}
+
+/**
+ * Takes pages for a new slab, and lays the objects out in them.  Must be called without the lock
+ * held, since the constructor runs on every object.
+ * @return Returns the new slab, which is not on any list yet, or NULL if no pages could be taken.
+ */
+SlabCache::Slab *SlabCache::create_slab()
+{
+	PageDescriptor *pages = buddy_alloc_pages(_slab_order, _type);
+	if (!pages) {
+		return NULL;
+	}
+
+	unsigned int colour;
+	{
+		UniqueIRQLock l;
+
+		colour = _next_colour;
+		_next_colour = (colour + 1) % _nr_colours;
+	}
+
+	Slab *slab = (Slab *)sys.mm().pgalloc().pgd_to_vpa(pages);
+	slab->pages = pages;
+	slab->next = NULL;
+	slab->prev = NULL;
+	slab->list = NULL;
+	slab->objects = (uint8_t *)slab + _objects_offset + colour * (_align > SLAB_CACHE_LINE ? _align : SLAB_CACHE_LINE);
+	slab->nr_free = _objects_per_slab;
+
+	// The lowest objects are handed out first, so they sit on the top of the stack.
+	uint16_t *free_indices = slab->free_indices();
+	for (unsigned int i = 0; i < _objects_per_slab; i++) {
+		free_indices[i] = _objects_per_slab - 1 - i;
+	}
+
+	if (_ctor) {
+		for (unsigned int i = 0; i < _objects_per_slab; i++) {
+			_ctor(slab->objects + i * _object_size);
+		}
+	}
+
+	return slab;
+}
+
+/**
+ * Runs the destructor on every object of a slab, and gives its pages back.  Must be called without
+ * the lock held, on a slab that has already been taken off its list.
+ * @param slab The slab to destroy.
+ */
+void SlabCache::destroy_slab(Slab *slab)
+{
+	if (_dtor) {
+		for (unsigned int i = 0; i < _objects_per_slab; i++) {
+			_dtor(slab->objects + i * _object_size);
+		}
+	}
+
+	buddy_free_pages(slab->pages, _slab_order);
+}
+
+/**
+ * Moves up to SLAB_MAGAZINE_BATCH free objects from the slabs into the magazine, taking them from
+ * partly used slabs before empty ones, so that empty slabs can be given back.  Must be called with
+ * the lock held.
+ * @return Returns the number of objects moved.
+ */
+unsigned int SlabCache::refill_magazine()
+{
+	unsigned int moved = 0;
+
+	while (moved < SLAB_MAGAZINE_BATCH && _magazine_count < SLAB_MAGAZINE_SIZE) {
+		Slab *slab = _partial ? _partial : _empty;
+		if (!slab) {
+			break;
+		}
+
+		uint16_t *free_indices = slab->free_indices();
+		while (slab->nr_free && moved < SLAB_MAGAZINE_BATCH && _magazine_count < SLAB_MAGAZINE_SIZE) {
+			_magazine[_magazine_count++] = slab->objects + free_indices[--slab->nr_free] * _object_size;
+			moved++;
+		}
+
+		move_slab(slab, slab->nr_free ? &_partial : &_full);
+	}
+
+	return moved;
+}
+
+/**
+ * Puts the objects at the bottom of the magazine, which have been there longest, back into their
+ * slabs.  Must be called with the lock held.
+ * @param count The number of objects to put back.
+ */
+void SlabCache::flush_magazine(unsigned int count)
+{
+	size_t slab_bytes = (size_t)PAGE_BYTES << _slab_order;
+
+	for (unsigned int i = 0; i < count; i++) {
+		uint8_t *object = (uint8_t *)_magazine[i];
+
+		// Slabs are aligned to their size, so the header is found from the object's address.
+		Slab *slab = (Slab *)((uintptr_t)object & ~(uintptr_t)(slab_bytes - 1));
+		slab->free_indices()[slab->nr_free++] = (object - slab->objects) / _object_size;
+
+		move_slab(slab, slab->nr_free == _objects_per_slab ? &_empty : &_partial);
+	}
+
+	for (unsigned int i = count; i < _magazine_count; i++) {
+		_magazine[i - count] = _magazine[i];
+	}
+
+	_magazine_count -= count;
+}
+
+/**
+ * Takes empty slabs off the empty list, to be destroyed once the lock is dropped.  Must be called
+ * with the lock held.
+ * @param keep The number of empty slabs to leave on the list.
+ * @return Returns the slabs taken, linked through next.
+ */
+SlabCache::Slab *SlabCache::take_empty_slabs(unsigned int keep)
+{
+	Slab *taken = NULL;
+
+	while (_nr_empty > keep) {
+		Slab *slab = _empty;
+		move_slab(slab, NULL);
+		_nr_slabs--;
+
+		slab->next = taken;
+		taken = slab;
+	}
+
+	return taken;
+}
+
+/**
+ * Moves a slab to the head of a list, or takes it off its list.  Must be called with the lock held.
+ * @param slab The slab to move.
+ * @param list The list to move it to, or NULL.
+ */
+void SlabCache::move_slab(Slab *slab, Slab **list)
+{
+	if (slab->list == list) {
+		return;
+	}
+
+	if (slab->list) {
+		if (slab->prev) {
+			slab->prev->next = slab->next;
+		} else {
+			*slab->list = slab->next;
+		}
+
+		if (slab->next) {
+			slab->next->prev = slab->prev;
+		}
+
+		if (slab->list == &_empty) {
+			_nr_empty--;
+		}
+	}
+
+	slab->list = list;
+	slab->prev = NULL;
+	slab->next = NULL;
+
+	if (list) {
+		slab->next = *list;
+		if (slab->next) {
+			slab->next->prev = slab;
+		}
+
+		*list = slab;
+
+		if (list == &_empty) {
+			_nr_empty++;
+		}
+	}
+}
@@ -0,0 +1,130 @@
+/*
+ * Slab Allocator
+ *
+ * Caches of small kernel objects of a single type, packed into slabs of pages taken from the buddy
+ * page allocator.  Objects are kept constructed while they are free, so a cache's constructor only runs
+ * when a slab is created, and its destructor when the slab is given back.
+ */
+#pragma once
+
+#include "buddy.h"
+
+// The size of a cache line, which is the step that slabs are coloured in.
+#define SLAB_CACHE_LINE		64
+// The largest slab, as a power of two number of pages.
+#define SLAB_MAX_ORDER		3
+// The number of free objects the magazine holds, and how many are moved between it and the slabs at once.
+#define SLAB_MAGAZINE_SIZE	32
+#define SLAB_MAGAZINE_BATCH	(SLAB_MAGAZINE_SIZE / 2)
+// The number of empty slabs a cache keeps, rather than giving them back to the page allocator.
+#define SLAB_EMPTY_HIGH		2
+
+class SlabCache {
+public:
+	/**
+	 * Creates a cache of objects.  No memory is taken until the first object is allocated.
+	 * @param name The name of the cache, for log messages.
+	 * @param object_size The size of each object, in bytes.
+	 * @param align The alignment of each object, which must be a power of two.
+	 * @param ctor Called on each object when its slab is created, or NULL.
+	 * @param dtor Called on each object when its slab is given back, or NULL.
+	 * @param type The migrate type of the slabs' pages.  Caches of objects that can be dropped under
+	 * memory pressure should use RECLAIMABLE.
+	 */
+	SlabCache(const char *name, size_t object_size, size_t align = sizeof(void *), void (*ctor)(void *) = NULL,
+		void (*dtor)(void *) = NULL, MigrateType::MigrateType type = MigrateType::UNMOVABLE);
+
+	/**
+	 * Gives every slab back to the page allocator.  Every object must have been freed.
+	 */
+	~SlabCache();
+
+	/**
+	 * Allocates an object, in the state the constructor, or the last user, left it in.  This is
+	 * O(1), unless a slab has to be created.
+	 * @return Returns the object, or NULL if no memory could be taken for it.
+	 */
+	void *alloc();
+
+	/**
+	 * Frees an object allocated from this cache.  This is O(1), unless an empty slab has to be given
+	 * back to the page allocator.
+	 * @param object The object to free, which should be in its constructed state.
+	 */
+	void free(void *object);
+
+	/**
+	 * Gives every empty slab back to the page allocator, including the slabs that only the magazine's
+	 * objects were keeping.
+	 * @return Returns the number of pages given back.
+	 */
+	unsigned int shrink();
+
+	/**
+	 * Returns the number of objects in each slab, which is zero if objects of this size do not fit
+	 * in a slab at all.
+	 */
+	unsigned int objects_per_slab() const { return _objects_per_slab; }
+
+	/**
+	 * Returns the size of each slab, as a power of two number of pages.
+	 */
+	int slab_order() const { return _slab_order; }
+
+	/**
+	 * Returns the number of slabs the cache holds.
+	 */
+	unsigned int nr_slabs() const { return _nr_slabs; }
+
+private:
+	struct Slab;
+
+	Slab *create_slab();
+	void destroy_slab(Slab *slab);
+	unsigned int refill_magazine();
+	void flush_magazine(unsigned int count);
+	Slab *take_empty_slabs(unsigned int keep);
+	void move_slab(Slab *slab, Slab **list);
+
+	const char *_name;
+	size_t _object_size;
+	size_t _align;
+	void (*_ctor)(void *);
+	void (*_dtor)(void *);
+	MigrateType::MigrateType _type;
+
+	// The layout of a slab: its order, how many objects it holds and where the first one starts, and
+	// how many colours there are room for.
+	int _slab_order;
+	unsigned int _objects_per_slab;
+	size_t _objects_offset;
+	unsigned int _nr_colours;
+	unsigned int _next_colour;
+
+	// Slabs with some objects free, with every object free, and with none free.
+	Slab *_partial;
+	Slab *_empty;
+	Slab *_full;
+	unsigned int _nr_slabs;
+	unsigned int _nr_empty;
+
+	// InfOS only brings up the boot CPU, so there is a single magazine of recently freed objects,
+	// which are the ones most likely to still be in the cache.
+	void *_magazine[SLAB_MAGAZINE_SIZE];
+	unsigned int _magazine_count;
+};
+
+/**
+ * A cache of objects of type T.  Objects are not constructed as T by the cache, but a constructor
+ * and destructor hook can be given for the state they should be kept in while free.
+ */
+template<typename T>
+class ObjectCache : public SlabCache {
+public:
+	ObjectCache(const char *name, void (*ctor)(void *) = NULL, void (*dtor)(void *) = NULL,
+		MigrateType::MigrateType type = MigrateType::UNMOVABLE)
+		: SlabCache(name, sizeof(T), alignof(T) > sizeof(void *) ? alignof(T) : sizeof(void *), ctor, dtor, type) { }
+
+	T *alloc() { return (T *)SlabCache::alloc(); }
+	void free(T *object) { SlabCache::free(object); }
+};